@@ -1,43 +1,257 @@
 // Pass based on Obfuscator-LLVM
-#define DEBUG_TYPE "bogus"
+#include <cmath>
+#include <numeric>
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/RandomNumberGenerator.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+#include "BogusPredicates.h"
 
 using namespace llvm;
+using namespace bogus;
+
+#define DEBUG_TYPE "bogus"
+
+enum SymStateKind { SymStateBlock, SymStateEntry, SymStateGlobal };
+
+static cl::opt<SymStateKind> SymState(
+    "bogus_sym_state",
+    cl::desc("Choose where the arrays of symbolic opaque predicates live"),
+    cl::values(clEnumValN(SymStateBlock, "block",
+                          "Allocate and fill the arrays at every predicate"),
+               clEnumValN(SymStateEntry, "entry",
+                          "Allocate and fill the arrays once per function "
+                          "in the entry block"),
+               clEnumValN(SymStateGlobal, "global",
+                          "Read the arrays from tables shared by the whole "
+                          "module")),
+    cl::init(SymStateBlock), cl::Optional);
+
+static cl::opt<unsigned> SymTableCount(
+    "bogus_sym_tables",
+    cl::desc("Number of table variants for -bogus_sym_state=global"),
+    cl::value_desc("count"), cl::init(8), cl::Optional);
+
+enum LoopModeKind { LoopsAll, LoopsOuter, LoopsNone };
+
+static cl::opt<LoopModeKind> LoopMode(
+    "bogus_loops", cl::desc("Choose which loop blocks get bogus control flow"),
+    cl::values(clEnumValN(LoopsAll, "all", "Obfuscate blocks in every loop"),
+               clEnumValN(LoopsOuter, "outer",
+                          "Do not obfuscate blocks of innermost loops"),
+               clEnumValN(LoopsNone, "none",
+                          "Do not obfuscate blocks of any loop")),
+    cl::init(LoopsAll), cl::Optional);
+
+static cl::opt<unsigned> HotPercentile(
+    "bogus_hot_percentile",
+    cl::desc("Do not obfuscate the blocks whose frequency is above this "
+             "percentile of the block frequencies of the function"),
+    cl::value_desc("percentile"), cl::init(100), cl::Optional);
+
+static cl::opt<unsigned> OverheadBudget(
+    "bogus_overhead_budget",
+    cl::desc("Obfuscate the coldest blocks only, until the estimated dynamic "
+             "overhead reaches this percentage of the function (0 = no "
+             "limit)"),
+    cl::value_desc("percentage"), cl::init(0), cl::Optional);
+
+static cl::opt<bool> BranchWeights(
+    "bogus_branch_weights",
+    cl::desc("Mark the real successor of opaque predicates as likely"),
+    cl::init(true), cl::Optional);
+
+static cl::opt<bool> ColdBlocks(
+    "bogus_cold_blocks",
+    cl::desc("Outline the altered blocks into cold functions placed in "
+             ".text.unlikely"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<unsigned> ShareFactor(
+    "bogus_share",
+    cl::desc("Number of obfuscated blocks sharing one decoy block (1 = a "
+             "copy of every block)"),
+    cl::value_desc("blocks"), cl::init(1), cl::Optional);
+
+static cl::opt<unsigned> PoolSize(
+    "bogus_pool_size",
+    cl::desc("Number of values in the per-module pool of opaque predicate "
+             "state (0 = two new globals per predicate)"),
+    cl::value_desc("size"), cl::init(0), cl::Optional);
+
+static cl::opt<unsigned> PredBudget(
+    "bogus_pred_budget",
+    cl::desc("Estimated cost the opaque predicates should add to one call "
+             "of a function (0 = no limit), exceeded when even the cheapest "
+             "predicate does not fit"),
+    cl::value_desc("cost"), cl::init(0), cl::Optional);
+
+STATISTIC(OverBudgetCount,
+          "The number of predicates placed over -bogus_pred_budget");
+STATISTIC(OverBudgetCost,
+          "The estimated cost per call added over -bogus_pred_budget");
+
+// Rough number of instructions executed on the real path of an obfuscated
+// block (two opaque predicates)
+static const unsigned PredicateCost = 16;
 
 namespace {
+
+// LLVM 10 replaced the alignments in bytes with llvm::Align
+#if LLVM_VERSION_MAJOR < 10
+unsigned toAlign(uint64_t Bytes) { return Bytes; }
+#else
+Align toAlign(uint64_t Bytes) { return Align(Bytes); }
+#endif
+
+// LLVM 12 returns the costs as InstructionCost, and takes the kind of cost
+// and the predicate of the comparisons
+#if LLVM_VERSION_MAJOR < 12
+int toCost(int Cost) { return Cost; }
+#else
+int toCost(InstructionCost Cost) { return *Cost.getValue(); }
+#endif
+
+// Estimated cost of the instructions of a predicate on the target
+int predicateCost(const TargetTransformInfo &TTI, Type *Ty,
+                  const std::vector<PredicateOp> &Ops) {
+  int cost = 0;
+  for (const PredicateOp &op : Ops) {
+    TargetTransformInfo::OperandValueKind Opd2 =
+        op.ConstOperand ? TargetTransformInfo::OK_UniformConstantValue
+                        : TargetTransformInfo::OK_AnyValue;
+    TargetTransformInfo::OperandValueProperties Opd2Prop =
+        op.PowerOf2 ? TargetTransformInfo::OP_PowerOf2
+                    : TargetTransformInfo::OP_None;
+#if LLVM_VERSION_MAJOR < 12
+    if (op.Opcode == Instruction::ICmp) {
+      cost += TTI.getCmpSelInstrCost(Instruction::ICmp, Ty);
+    } else if (Instruction::isCast(op.Opcode)) {
+      cost += TTI.getCastInstrCost(
+          op.Opcode, Ty, Type::getIntNTy(Ty->getContext(), op.SrcBits));
+    } else if (op.Opcode == Instruction::Load ||
+               op.Opcode == Instruction::Store) {
+      cost += TTI.getMemoryOpCost(op.Opcode, Ty, 8, 0);
+    } else {
+      cost += TTI.getArithmeticInstrCost(
+          op.Opcode, Ty, TargetTransformInfo::OK_AnyValue, Opd2,
+          TargetTransformInfo::OP_None, Opd2Prop);
+    }
+#else
+    if (op.Opcode == Instruction::ICmp) {
+      cost += toCost(TTI.getCmpSelInstrCost(Instruction::ICmp, Ty, nullptr,
+                                            CmpInst::BAD_ICMP_PREDICATE));
+    } else if (Instruction::isCast(op.Opcode)) {
+      cost += toCost(TTI.getCastInstrCost(
+          op.Opcode, Ty, Type::getIntNTy(Ty->getContext(), op.SrcBits),
+          TargetTransformInfo::CastContextHint::None,
+          TargetTransformInfo::TCK_RecipThroughput));
+    } else if (op.Opcode == Instruction::Load ||
+               op.Opcode == Instruction::Store) {
+      cost += toCost(TTI.getMemoryOpCost(op.Opcode, Ty, toAlign(8), 0));
+    } else {
+      cost += toCost(TTI.getArithmeticInstrCost(
+          op.Opcode, Ty, TargetTransformInfo::TCK_RecipThroughput,
+          TargetTransformInfo::OK_AnyValue, Opd2,
+          TargetTransformInfo::OP_None, Opd2Prop));
+    }
+#endif
+  }
+  return cost;
+}
+
 struct BogusFlowPass : public FunctionPass {
 
   std::vector<Value *> IntegerVect;
-  bool changed = false;
+  // Always-true placeholder branches created by AddBogus for the current
+  // function, with the frequency of the block they obfuscate. They are
+  // turned into opaque predicates by doF
+  std::vector<std::pair<BranchInst *, uint64_t>> Placeholders;
+  // Altered blocks created for the current function
+  std::vector<BasicBlock *> AlteredBlocks;
+  // Decoy blocks shared by several blocks of the current function
+  // (-bogus_share), and the number of blocks using them so far
+  std::vector<BasicBlock *> SharedDecoys;
+  unsigned SharedUses = 0;
+  // Real successors of the blocks sharing each decoy, linkDecoys branches
+  // back to one of them
+  DenseMap<BasicBlock *, SmallVector<BasicBlock *, 4>> DecoyExits;
+  // Arrays shared by the symbolic predicates of the current function
+  // (-bogus_sym_state=entry)
+  std::pair<AllocaInst *, AllocaInst *> EntryArrays;
+  // Pool of opaque predicate state of the module (-bogus_pool_size)
+  GlobalVariable *Pool = nullptr;
+  // Tables of the symbolic predicates (-bogus_sym_state=global)
+  GlobalVariable *SymTables = nullptr;
+  // Functions holding the outlined altered blocks (-bogus_cold_blocks). The
+  // pass manager visits them too, they are left as they are
+  SmallPtrSet<Function *, 16> ColdFunctions;
   static char ID;
   BogusFlowPass() : FunctionPass(ID) {}
 
   void Bogus(Function &F);
+  void selectBlocks(std::list<BasicBlock *> &basicBlocks);
+  void outlineCold(BasicBlock *altered);
+  void linkDecoys(Function &F);
   void AddBogus(BasicBlock *basicBlock, Function &F);
   BasicBlock *createAltered(BasicBlock *basicBlock, const Twine &Name,
                             Function *F);
-  bool doF(Module &M);
+  bool doF(Function &F);
+  std::pair<AllocaInst *, AllocaInst *> createSymArrays(Module &M,
+                                                        Instruction *inst,
+                                                        unsigned size);
   Value *getSymOP(Module &M, Instruction *inst, Value *arg);
+  Value *getSymTableOP(Module &M, Instruction *inst, Value *arg);
+  Value *loadState(Module &M, IRBuilder<> &Builder, const Twine &Name);
   Value *getSimpleOP(Module &M, Instruction *inst,
-                     std::vector<Value *> &argVec);
+                     std::vector<Value *> &argVec,
+                     const OpaquePredicate &opaquePred);
+  int getSymOPCost(const TargetTransformInfo &TTI, Module &M);
+  int getSimpleOPCost(const TargetTransformInfo &TTI, Module &M,
+                      std::vector<Value *> &argVec,
+                      const OpaquePredicate &opaquePred);
+
+  virtual bool doInitialization(Module &) {
+    Pool = nullptr;
+    SymTables = nullptr;
+    ColdFunctions.clear();
+    return false;
+  }
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+  }
 
   virtual bool runOnFunction(Function &F) {
+    if (ColdFunctions.count(&F))
+      return false;
     Bogus(F);
-    doF(*F.getParent());
-    return changed;
+    return doF(F);
   } // runOnFunction
 };  // Pass
 
@@ -49,12 +263,87 @@ void BogusFlowPass::Bogus(Function &F) {
   for (auto BBi = F.begin(); BBi != F.end(); ++BBi) {
     basicBlocks.push_back(&*BBi);
   }
+  // Keep the loops the vectorizer and the other loop passes work on
+  // intact, the cycles between original and altered blocks are irreducible
+  if (LoopMode != LoopsAll) {
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    basicBlocks.remove_if([&](BasicBlock *BB) {
+      Loop *L = LI.getLoopFor(BB);
+      return L && (LoopMode == LoopsNone || L->getSubLoops().empty());
+    });
+  }
+  if (HotPercentile < 100 || OverheadBudget > 0) {
+    selectBlocks(basicBlocks);
+  }
 
   while (!basicBlocks.empty()) {
     BasicBlock *basicBlock = basicBlocks.front();
     AddBogus(basicBlock, F);
     basicBlocks.pop_front();
   }
+  if (!SharedDecoys.empty()) {
+    linkDecoys(F);
+  }
+
+  // The altered blocks never execute, keep them out of the hot code
+  if (ColdBlocks) {
+    for (BasicBlock *altered : AlteredBlocks) {
+      outlineCold(altered);
+    }
+  }
+  AlteredBlocks.clear();
+}
+
+/* selectBlocks
+ *
+ * Drop the blocks that are too hot to be obfuscated. Block frequencies come
+ * from the !prof metadata when the module was compiled with a profile
+ * (-fprofile-instr-use, -fprofile-sample-use), and are estimated from the
+ * CFG and loops otherwise.
+ */
+void BogusFlowPass::selectBlocks(std::list<BasicBlock *> &basicBlocks) {
+  BlockFrequencyInfo &BFI =
+      getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  std::vector<std::pair<uint64_t, BasicBlock *>> byFreq;
+  long double dynamicSize = 0;
+  for (BasicBlock *BB : basicBlocks) {
+    uint64_t freq = BFI.getBlockFreq(BB).getFrequency();
+    byFreq.push_back({freq, BB});
+    dynamicSize += (long double)freq * BB->size();
+  }
+  std::stable_sort(byFreq.begin(), byFreq.end(),
+                   [](const std::pair<uint64_t, BasicBlock *> &a,
+                      const std::pair<uint64_t, BasicBlock *> &b) {
+                     return a.first < b.first;
+                   });
+
+  // Skip the blocks above the hotness percentile
+  if (HotPercentile < 100 && !byFreq.empty()) {
+    uint64_t threshold = byFreq[(byFreq.size() - 1) * HotPercentile / 100].first;
+    while (!byFreq.empty() && byFreq.back().first > threshold) {
+      byFreq.pop_back();
+    }
+  }
+
+  // Take the coldest blocks until the overhead budget is spent
+  if (OverheadBudget > 0) {
+    long double budget = dynamicSize * OverheadBudget / 100;
+    long double spent = 0;
+    size_t taken = 0;
+    for (; taken < byFreq.size(); ++taken) {
+      spent += (long double)byFreq[taken].first * PredicateCost;
+      if (spent > budget)
+        break;
+    }
+    byFreq.resize(taken);
+  }
+
+  SmallPtrSet<BasicBlock *, 32> selected;
+  for (auto &entry : byFreq) {
+    selected.insert(entry.second);
+  }
+  basicBlocks.remove_if(
+      [&](BasicBlock *BB) { return !selected.count(BB); });
 }
 
 void BogusFlowPass::AddBogus(BasicBlock *basicBlock, Function &F) {
@@ -62,18 +351,38 @@ void BogusFlowPass::AddBogus(BasicBlock *basicBlock, Function &F) {
   if (basicBlock->getFirstNonPHIOrDbgOrLifetime()) {
     i1 = (BasicBlock::iterator)basicBlock->getFirstNonPHIOrDbgOrLifetime();
   }
+  // Leave the static allocas in the entry block, mem2reg and SROA only
+  // promote allocas of the entry block
+  if (basicBlock == &F.getEntryBlock()) {
+    while (isa<AllocaInst>(i1)) {
+      ++i1;
+    }
+  }
 
   // Obfuscating Landing Pad block would result in errors
   if (isa<LandingPadInst>(i1)) {
     return;
   }
+  uint64_t freq = getAnalysis<BlockFrequencyInfoWrapperPass>()
+                      .getBFI()
+                      .getBlockFreq(basicBlock)
+                      .getFrequency();
   BasicBlock *original = basicBlock->splitBasicBlock(i1, "original");
-  BasicBlock *altered = createAltered(original, "copy", &F);
-
-  // Now that all the blocks are created,
-  // we modify the terminators to adjust the control flow.
+  BasicBlock *altered;
+  bool shared = ShareFactor > 1;
+  if (!shared || SharedUses++ % ShareFactor == 0) {
+    altered = createAltered(original, shared ? "decoy" : "copy", &F);
+    AlteredBlocks.push_back(altered);
+    // Now that all the blocks are created,
+    // we modify the terminators to adjust the control flow.
+    altered->getTerminator()->eraseFromParent();
+    if (shared) {
+      SharedDecoys.push_back(altered);
+    }
+  } else {
+    altered = SharedDecoys.back();
+  }
 
-  altered->getTerminator()->eraseFromParent();
   basicBlock->getTerminator()->eraseFromParent();
 
   // Preparing a condition..
@@ -86,10 +395,15 @@ void BogusFlowPass::AddBogus(BasicBlock *basicBlock, Function &F) {
 
   // Jump to the original basic block if the condition is true or
   // to the altered block if false.
-  BranchInst::Create(original, altered, (Value *)condition, basicBlock);
+  Placeholders.push_back(
+      {BranchInst::Create(original, altered, (Value *)condition, basicBlock),
+       freq});
 
   // The altered block loop back on the original one.
-  BranchInst::Create(original, altered);
+  // Shared decoys are linked together by linkDecoys instead.
+  if (!shared) {
+    BranchInst::Create(original, altered);
+  }
 
   // The end of the original is modified to give the impression that sometimes
   // it continues in the loop, and sometimes it returns the desired value
@@ -105,10 +419,138 @@ void BogusFlowPass::AddBogus(BasicBlock *basicBlock, Function &F) {
   // The first part goes either to the return statement or to the begining
   // of the altered block. So we erase the terminator created when splitting.
   original->getTerminator()->eraseFromParent();
+  if (shared) {
+    for (BasicBlock *succ : successors(originalpart2)) {
+      DecoyExits[altered].push_back(succ);
+    }
+  }
 
   FCmpInst *condition2 =
       new FCmpInst(*original, CmpInst::FCMP_TRUE, LHS, RHS, "condition2");
-  BranchInst::Create(originalpart2, altered, (Value *)condition2, original);
+  Placeholders.push_back({BranchInst::Create(originalpart2, altered,
+                                             (Value *)condition2, original),
+                          freq});
+}
+
+/* linkDecoys
+ *
+ * Finish the decoy blocks shared by several obfuscated blocks. A shared
+ * decoy cannot loop back to the block it was copied from, as that block
+ * would no longer be dominated by its own definitions, so the decoys jump
+ * to each other in a ring. Each decoy also branches back to real code, on
+ * a condition always true, so the ring does not stand out as an infinite
+ * loop, which would be undefined in a mustprogress function. The target is
+ * a successor of a block sharing the decoy, or any block, whose immediate
+ * dominator dominates the decoy: the edge then leaves the dominator tree
+ * unchanged. Operands of a decoy that no longer dominate it, and the
+ * incoming values of the decoys in the PHIs of the targets, are random
+ * values of the same type.
+ */
+void BogusFlowPass::linkDecoys(Function &F) {
+  std::random_device dev;
+  std::mt19937 rng(dev());
+  Module &M = *F.getParent();
+  auto randomValue = [&](Type *ty) -> Value * {
+    if (ty->isIntegerTy())
+      return ConstantInt::get(ty, rng());
+    return UndefValue::get(ty);
+  };
+  for (size_t i = 0; i < SharedDecoys.size(); ++i) {
+    BranchInst::Create(SharedDecoys[(i + 1) % SharedDecoys.size()],
+                       SharedDecoys[i]);
+  }
+
+  DominatorTree DT(F);
+  SmallPtrSet<BasicBlock *, 16> decoys(SharedDecoys.begin(),
+                                       SharedDecoys.end());
+  for (BasicBlock *decoy : SharedDecoys) {
+    auto canExit = [&](BasicBlock *target) {
+      DomTreeNode *node = DT.getNode(target);
+      return node && node->getIDom() && !decoys.count(target) &&
+             !target->isEHPad() &&
+             DT.dominates(node->getIDom()->getBlock(), decoy);
+    };
+    std::vector<BasicBlock *> exits;
+    for (BasicBlock *succ : DecoyExits[decoy]) {
+      if (canExit(succ))
+        exits.push_back(succ);
+    }
+    if (exits.empty()) {
+      for (BasicBlock &BB : F) {
+        if (canExit(&BB))
+          exits.push_back(&BB);
+      }
+    }
+    if (exits.empty())
+      continue;
+    std::uniform_int_distribution<size_t> pick(0, exits.size() - 1);
+    BasicBlock *exit = exits[pick(rng)];
+
+    // The state is in 1..127
+    BranchInst *ring = cast<BranchInst>(decoy->getTerminator());
+    IRBuilder<> Builder(ring);
+    Value *state = loadState(M, Builder, "decoy_state");
+    Value *cond = Builder.CreateICmpULT(
+        state, ConstantInt::get(state->getType(), INT8_MAX + 1));
+    Builder.CreateCondBr(cond, exit, ring->getSuccessor(0));
+    ring->eraseFromParent();
+    for (PHINode &phi : exit->phis()) {
+      phi.addIncoming(randomValue(phi.getType()), decoy);
+    }
+  }
+
+  for (BasicBlock *decoy : SharedDecoys) {
+    for (Instruction &inst : *decoy) {
+      for (Use &U : inst.operands()) {
+        Instruction *def = dyn_cast<Instruction>(U.get());
+        if (!def || DT.dominates(def, U))
+          continue;
+        U.set(randomValue(def->getType()));
+      }
+    }
+  }
+  SharedDecoys.clear();
+  DecoyExits.clear();
+  SharedUses = 0;
+}
+
+/* outlineCold
+ *
+ * Move an altered block into its own function. The function is marked cold
+ * and gets the .unlikely section prefix, so its code ends up in
+ * .text.unlikely, away from the hot code of the obfuscated function. The
+ * call left in place of the block is never executed. Blocks reading the
+ * promotable allocas of the function stay in place, so run the pass after
+ * mem2reg or SROA for it to outline most of them.
+ */
+void BogusFlowPass::outlineCold(BasicBlock *altered) {
+  CodeExtractor CE(altered, /*DT=*/nullptr, /*AggregateArgs=*/false,
+                   /*BFI=*/nullptr, /*BPI=*/nullptr, /*AC=*/nullptr,
+                   /*AllowVarArgs=*/false, /*AllowAlloca=*/true, "cold");
+  if (!CE.isEligible())
+    return;
+  // Passing an alloca to the outlined function makes it escape, mem2reg
+  // could no longer promote it and the hot code would go through memory
+  SetVector<Value *> Inputs, Outputs, Allocas;
+  CE.findInputsOutputs(Inputs, Outputs, Allocas);
+  if (any_of(Inputs, [](Value *V) {
+        auto *AI = dyn_cast<AllocaInst>(V);
+        return AI && isAllocaPromotable(AI);
+      }))
+    return;
+#if LLVM_VERSION_MAJOR < 10
+  Function *coldF = CE.extractCodeRegion();
+#else
+  // LLVM 10 made the caller provide the analysis of the function
+  CodeExtractorAnalysisCache CEAC(*altered->getParent());
+  Function *coldF = CE.extractCodeRegion(CEAC);
+#endif
+  if (!coldF)
+    return;
+  ColdFunctions.insert(coldF);
+  coldF->addFnAttr(Attribute::Cold);
+  coldF->addFnAttr(Attribute::NoInline);
+  coldF->setSectionPrefix(".unlikely");
 }
 
 BasicBlock *BogusFlowPass::createAltered(BasicBlock *basicBlock,
@@ -151,105 +593,176 @@ BasicBlock *BogusFlowPass::createAltered(BasicBlock *basicBlock,
   return altered;
 }
 
-/* doFinalization
+/* doF
  *
- * Overwrite FunctionPass method to apply the transformations to the whole
- * module. This part obfuscate all the always true predicates of the module.
- * More precisely, the condition which predicate is FCMP_TRUE.
- * It also remove all the functions' basic blocks' and instructions' names.
+ * Obfuscate the always true predicates (FCMP_TRUE) created by AddBogus for
+ * the function F. The placeholder branches are collected in a worklist while
+ * the function is being transformed, so every function is rewritten exactly
+ * once instead of rescanning every terminator of the module.
  */
-bool BogusFlowPass::doF(Module &M) {
+bool BogusFlowPass::doF(Function &F) {
   std::random_device dev;
   std::mt19937 rng(dev());
   std::uniform_int_distribution<std::mt19937::result_type> dist(0, 1);
-  std::vector<Instruction *> toEdit, toDelete;
   std::vector<Value *> argVec;
-  Value *argValue, *symVal, *pred;
-  Type *argType;
-
-  for (Module::iterator mi = M.begin(), me = M.end(); mi != me; ++mi) {
-    for (Function::iterator fi = mi->begin(), fe = mi->end(); fi != fe; ++fi) {
-      Instruction *ti = fi->getTerminator();
-      if (ti->getOpcode() == Instruction::Br) {
-        BranchInst *br = (BranchInst *)(ti);
-        if (br->isConditional()) {
-          FCmpInst *cond = (FCmpInst *)br->getCondition();
-          unsigned opcode = cond->getOpcode();
-          if (opcode == Instruction::FCmp) {
-            if (cond->getPredicate() == FCmpInst::FCMP_TRUE) {
-              toDelete.push_back(cond);
-              toEdit.push_back(ti);
-            }
-          }
-        }
-      }
-    } // function loop
-  }   // module loop
+  Module &M = *F.getParent();
+  MDBuilder MDB(F.getContext());
+  Value *pred;
+
+  if (Placeholders.empty())
+    return false;
+  EntryArrays = {nullptr, nullptr};
+
+  // Check if function has an integer arguments
+  // and store them in argVec
+  for (Argument &arg : F.args()) {
+    Type *argType = arg.getType();
+    if (argType->isIntegerTy() && argType->getIntegerBitWidth() == 32) {
+      argVec.push_back(&arg);
+      if (argVec.size() >= 2)
+        break; // Don't need more than 2 int args
+    }
+  }
+
+  // Cost of every predicate for this function
+  const TargetTransformInfo &TTI =
+      getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+  std::vector<OpaquePredicate> &library = predicateLibrary();
+  std::vector<int> simpleCosts;
+  for (const OpaquePredicate &opaquePred : library) {
+    simpleCosts.push_back(getSimpleOPCost(TTI, M, argVec, opaquePred));
+  }
+  int symCost = getSymOPCost(TTI, M);
+  size_t cheapest = std::min_element(simpleCosts.begin(), simpleCosts.end()) -
+                    simpleCosts.begin();
+  uint64_t entryFreq = getAnalysis<BlockFrequencyInfoWrapperPass>()
+                           .getBFI()
+                           .getEntryFreq();
+  long double budget = PredBudget;
+
+  // With a budget, choose the predicates of the coldest blocks first, so
+  // that the expensive ones end up on cold paths and the hot blocks get
+  // whatever is left
+  if (PredBudget > 0) {
+    std::stable_sort(Placeholders.begin(), Placeholders.end(),
+                     [](const std::pair<BranchInst *, uint64_t> &a,
+                        const std::pair<BranchInst *, uint64_t> &b) {
+                       return a.second < b.second;
+                     });
+  }
 
   // Replace all the branches found
-  for (auto BBi = toEdit.begin(); BBi != toEdit.end(); ++BBi) {
-    // Check if function has an integer arguments
-    // and store them in argVec
-    Function *F = (*BBi)->getParent()->getParent();
-    for (Function::arg_iterator argIt = F->arg_begin(); argIt != F->arg_end();
-         ++argIt) {
-      argValue = &*argIt;
-      argType = argValue->getType();
-      if (argType->isIntegerTy()) {
-        if (argType->getIntegerBitWidth() == 32) {
-          argVec.push_back(argValue);
-        }
-        /* if (isa<ConstantInt>(argValue))
-        symVal = argValue; */
-        if (argVec.size() >= 2)
-          break; // Don't need more than 2 int args
+  for (auto &placeholder : Placeholders) {
+    BranchInst *br = placeholder.first;
+    Instruction *cond = cast<Instruction>(br->getCondition());
+
+    if (PredBudget > 0) {
+      // Number of times the predicate runs per call of the function
+      long double execs =
+          entryFreq ? (long double)placeholder.second / entryFreq : 1;
+      // Candidates that fit in the rest of the budget (the last index
+      // stands for the symbolic predicate)
+      std::vector<size_t> fitting;
+      for (size_t i = 0; i < library.size(); ++i) {
+        if (simpleCosts[i] * execs <= budget)
+          fitting.push_back(i);
       }
-    }
+      if (!argVec.empty() && symCost * execs <= budget)
+        fitting.push_back(library.size());
 
-    // Try to construct symbolic OP using arrays
-    // Use Simple OP if it fails
-    // TODO use deterministic RNG
-    if (!argVec.empty() && dist(rng)) {
-      pred = getSymOP(M, *BBi, argVec[0]);
+      size_t choice = cheapest;
+      if (!fitting.empty()) {
+        std::uniform_int_distribution<size_t> pick(0, fitting.size() - 1);
+        choice = fitting[pick(rng)];
+      }
+      if (choice == library.size()) {
+        pred = getSymOP(M, br, argVec[0]);
+        budget -= symCost * execs;
+      } else {
+        pred = getSimpleOP(M, br, argVec, library[choice]);
+        budget -= simpleCosts[choice] * execs;
+      }
+      // Nothing fit, the cheapest predicate goes over the budget
+      if (budget < 0) {
+        ++OverBudgetCount;
+        OverBudgetCost += (uint64_t)std::ceil(-budget);
+        budget = 0;
+      }
+    } else if (!argVec.empty() && dist(rng)) {
+      // Try to construct symbolic OP using arrays
+      // Use Simple OP if it fails
+      // TODO use deterministic RNG
+      pred = getSymOP(M, br, argVec[0]);
     } else {
-      pred = getSimpleOP(M, *BBi, argVec);
+      std::uniform_int_distribution<size_t> pick(0, library.size() - 1);
+      pred = getSimpleOP(M, br, argVec, library[pick(rng)]);
     }
 
-    // Create BranchInst with successors of original BranchInst (BBi),
+    // Create BranchInst with successors of original BranchInst,
     // use the opaque pred as condition
     // and insert at the end of the BB
-    BranchInst::Create(((BranchInst *)*BBi)->getSuccessor(0),
-                       ((BranchInst *)*BBi)->getSuccessor(1), (Value *)pred,
-                       ((BranchInst *)*BBi)->getParent());
-    (*BBi)->eraseFromParent(); // erase the branch
-  }
-
-  for (auto BBi = toDelete.begin(); BBi != toDelete.end(); ++BBi) {
-    (*BBi)->eraseFromParent();
+    BranchInst *opaqueBr = BranchInst::Create(
+        br->getSuccessor(0), br->getSuccessor(1), pred, br->getParent());
+    // The predicate is always true, tell the block placement and the branch
+    // predictor hints about it
+    if (BranchWeights) {
+      opaqueBr->setMetadata(LLVMContext::MD_prof,
+                            MDB.createBranchWeights((1U << 20) - 1, 1));
+    }
+    br->eraseFromParent(); // erase the branch
+    cond->eraseFromParent();
   }
+  Placeholders.clear();
   return true;
 } // doF
 
-Value *BogusFlowPass::getSimpleOP(Module &M, Instruction *inst,
-                                  std::vector<Value *> &argVec) {
+/* loadState
+ *
+ * Load a random value in the range 1..127 that the optimizer cannot see
+ * through. By default every call creates a new global. With
+ * -bogus_pool_size, the value is taken from a random slot of a single
+ * internal array per module, which keeps the number of symbols constant.
+ */
+Value *BogusFlowPass::loadState(Module &M, IRBuilder<> &Builder,
+                                const Twine &Name) {
   std::random_device dev;
   std::mt19937 rng(dev());
   std::uniform_int_distribution<std::mt19937::result_type> dist(1, INT8_MAX);
-  std::uniform_int_distribution<std::mt19937::result_type> randMBA(
-      1, 4); // for OP selection
   Type *i32_type = Type::getInt32Ty(M.getContext());
-  IRBuilder<> Builder(inst->getParent());
 
-  Value *x1 = ConstantInt::get(i32_type, 0);
-  Value *y1 = ConstantInt::get(i32_type, 0);
+  if (PoolSize == 0) {
+    Value *x1 = ConstantInt::get(i32_type, 0);
+    GlobalVariable *x =
+        new GlobalVariable(M, i32_type, false, GlobalValue::LinkOnceAnyLinkage,
+                           (Constant *)x1, Name);
+    x->setInitializer(ConstantInt::get(i32_type, dist(rng)));
+    return Builder.CreateLoad(i32_type, x, Name);
+  }
 
-  GlobalVariable *x = new GlobalVariable(
-      M, i32_type, false, GlobalValue::LinkOnceAnyLinkage, (Constant *)x1, "x");
-  GlobalVariable *y = new GlobalVariable(
-      M, i32_type, false, GlobalValue::LinkOnceAnyLinkage, (Constant *)y1, "y");
+  ArrayType *poolType = ArrayType::get(i32_type, PoolSize);
+  if (!Pool) {
+    std::vector<Constant *> values;
+    for (unsigned i = 0; i < PoolSize; ++i) {
+      values.push_back(ConstantInt::get(i32_type, dist(rng)));
+    }
+    // Internal, so it does not end up in the dynamic symbol table, and
+    // externally initialized, so its values cannot be propagated
+    Pool = new GlobalVariable(M, poolType, false, GlobalValue::InternalLinkage,
+                              ConstantArray::get(poolType, values),
+                              "bogus_pool");
+    Pool->setExternallyInitialized(true);
+  }
+  std::uniform_int_distribution<unsigned> slot(0, PoolSize - 1);
+  Value *gep =
+      Builder.CreateConstInBoundsGEP2_32(poolType, Pool, 0, slot(rng));
+  return Builder.CreateLoad(i32_type, gep, Name);
+}
 
-  x->setInitializer(ConstantInt::get(i32_type, dist(rng)));
-  y->setInitializer(ConstantInt::get(i32_type, dist(rng)));
+Value *BogusFlowPass::getSimpleOP(Module &M, Instruction *inst,
+                                  std::vector<Value *> &argVec,
+                                  const OpaquePredicate &opaquePred) {
+  Type *i32_type = Type::getInt32Ty(M.getContext());
+  IRBuilder<> Builder(inst->getParent());
 
   // Try to use function arguments instead of globals
   Value *opX, *opY;
@@ -262,66 +775,59 @@ Value *BogusFlowPass::getSimpleOP(Module &M, Instruction *inst,
   } else if (argVec.size() == 1) {
     opX = Builder.CreateSRem(argVec[0], ConstantInt::get(i32_type, INT8_MAX),
                              "X_REM");
-    opY = Builder.CreateLoad((Value *)y, "y");
+    opY = loadState(M, Builder, "y");
   } else {
-    opX = Builder.CreateLoad((Value *)x, "x");
-    opY = Builder.CreateLoad((Value *)y, "y");
-  }
-
-  short rand = randMBA(rng);
-  Value *res = nullptr;
-  switch (rand) {
-  case 1: // 7y^2 - 1 != x
-    res = Builder.CreateICmpNE(
-        Builder.CreateSub(Builder.CreateMul(ConstantInt::get(i32_type, 7),
-                                            Builder.CreateMul(opY, opY)),
-                          ConstantInt::get(i32_type, 1)),
-        opX);
-    break;
-  case 2: // (x^2 + 1) % 7 != 0
-    res = Builder.CreateICmpNE(
-        Builder.CreateSRem(Builder.CreateAdd(Builder.CreateMul(opX, opX),
-                                             ConstantInt::get(i32_type, 1)),
-                           ConstantInt::get(i32_type, 7)),
-        ConstantInt::get(i32_type, 0));
-    break;
-  case 3: // (x^2 + x + 7) % 81 != 0
-    res = Builder.CreateICmpNE(
-        Builder.CreateSRem(
-            Builder.CreateAdd(
-                Builder.CreateAdd(Builder.CreateMul(opX, opX), opX),
-                ConstantInt::get(i32_type, 7)),
-            ConstantInt::get(i32_type, 81)),
-        ConstantInt::get(i32_type, 0));
-    break;
-  case 4: // (4x^2 + 4) % 19 != 0
-    res = res = Builder.CreateICmpNE(
-        Builder.CreateSRem(
-            Builder.CreateAdd(Builder.CreateMul(Builder.CreateMul(opX, opX),
-                                                ConstantInt::get(i32_type, 4)),
-                              ConstantInt::get(i32_type, 4)),
-            ConstantInt::get(i32_type, 19)),
-        ConstantInt::get(i32_type, 0));
-    break;
+    opX = loadState(M, Builder, "x");
+    opY = loadState(M, Builder, "y");
   }
-  return res;
+
+  return opaquePred.Build(Builder, opX, opY);
 }
 
-// Based on https://github.com/hxuhack/symobfuscator-deprecated-
-Value *BogusFlowPass::getSymOP(Module &M, Instruction *inst, Value *arg) {
-  IRBuilder<> Builder(inst);
-  Type *argType = arg->getType();
+// Estimated cost of a simple predicate, including the computation of its
+// operands
+int BogusFlowPass::getSimpleOPCost(const TargetTransformInfo &TTI, Module &M,
+                                   std::vector<Value *> &argVec,
+                                   const OpaquePredicate &opaquePred) {
+  std::vector<PredicateOp> ops = opaquePred.Ops;
+  for (size_t i = 0; i < 2; ++i) {
+    if (i < argVec.size()) {
+      ops.push_back({Instruction::SRem, true});
+    } else {
+      ops.push_back({Instruction::Load, false});
+    }
+  }
+  return predicateCost(TTI, Type::getInt32Ty(M.getContext()), ops);
+}
 
-  std::random_device dev;
-  std::mt19937 rng(dev());
-  std::uniform_int_distribution<std::mt19937::result_type> dist(5, 10);
-  unsigned size = 8; // dist(rng);
+// Estimated cost of a symbolic predicate, see getSymOP
+int BogusFlowPass::getSymOPCost(const TargetTransformInfo &TTI, Module &M) {
+  // The argument is an i32, the remainder is taken by the array size
+  std::vector<PredicateOp> ops = {
+      {Instruction::SExt, false, false, 32},
+      {Instruction::URem, true, isPowerOf2_32(SymArraySize)},
+      {Instruction::Load, false},
+      {Instruction::Load, false},
+      {Instruction::ICmp, false}};
+  if (SymState == SymStateBlock) {
+    // Filling the arrays and spilling the argument
+    ops.insert(ops.end(), 2 * SymArraySize + 1, {Instruction::Store, false});
+    ops.push_back({Instruction::Load, false});
+  } else if (SymState == SymStateGlobal) {
+    // Offset of the second array
+    ops.push_back({Instruction::ZExt, false, false, 8});
+    ops.push_back({Instruction::Add, true});
+  }
+  return predicateCost(TTI, Type::getInt64Ty(M.getContext()), ops);
+}
 
+// Allocate the two arrays used by symbolic predicates before inst and fill
+// them with 0..size-1
+std::pair<AllocaInst *, AllocaInst *>
+BogusFlowPass::createSymArrays(Module &M, Instruction *inst, unsigned size) {
   const DataLayout &DL = M.getDataLayout();
   ConstantInt *i0_32 = (ConstantInt *)ConstantInt::getSigned(
       Type::getInt32Ty(M.getContext()), 0);
-  ConstantInt *size_i64 = dyn_cast<ConstantInt>(
-      ConstantInt::getSigned(Type::getInt64Ty(M.getContext()), size));
 
   // Define arrays
   ArrayType *arr_type1 = ArrayType::get(Type::getInt64Ty(M.getContext()), size);
@@ -346,7 +852,7 @@ Value *BogusFlowPass::getSymOP(Module &M, Instruction *inst, Value *arg) {
     vec.push_back(ci);
     ArrayRef<Value *> arr(vec);
     gepVec1.push_back(GetElementPtrInst::CreateInBounds(
-        (Value *)arr_alloc1, arr, "l1_arrayidx", inst));
+        arr_type1, arr_alloc1, arr, "l1_arrayidx", inst));
   }
 
   for (int i = 0; i < gepVec1.size(); i++) {
@@ -363,7 +869,7 @@ Value *BogusFlowPass::getSymOP(Module &M, Instruction *inst, Value *arg) {
     vec.push_back(ci);
     ArrayRef<Value *> arr(vec);
     gepVec2.push_back(GetElementPtrInst::CreateInBounds(
-        (Value *)arr_alloc2, arr, "l2_arrayidx", inst));
+        arr_type2, arr_alloc2, arr, "l2_arrayidx", inst));
   }
 
   for (int i = 0; i < gepVec2.size(); i++) {
@@ -372,20 +878,122 @@ Value *BogusFlowPass::getSymOP(Module &M, Instruction *inst, Value *arg) {
     storeVec2.push_back(new StoreInst(ci, gepVec2[i], inst));
   }
 
-  Value *allocaInst = Builder.CreateAlloca(argType, DL.getAllocaAddrSpace(),
-                                           nullptr, "allocaInst");
-  Value *storeInst = Builder.CreateStore(arg, allocaInst);
-  Value *loadInst = Builder.CreateLoad(allocaInst, "loadInst");
+  return {arr_alloc1, arr_alloc2};
+}
 
-  // Remainder instruction
+/* getSymTableOP
+ *
+ * Symbolic predicate reading its arrays from tables shared by the module.
+ * Each variant holds two random permutations of 0..7, arr1 and arr2, packed
+ * as 16 bytes, so four variants share a cache line. The predicate is
+ * arr2[arr1[x % 8]] != 8, i.e. two dependent loads. The tables are never
+ * written, but they are not marked constant: the optimizer would fold
+ * comparisons of loads from a constant array.
+ */
+Value *BogusFlowPass::getSymTableOP(Module &M, Instruction *inst, Value *arg) {
+  std::random_device dev;
+  std::mt19937 rng(dev());
+  IRBuilder<> Builder(inst);
+  LLVMContext &ctx = M.getContext();
+  Type *i8_type = Type::getInt8Ty(ctx);
+  Type *i64_type = Type::getInt64Ty(ctx);
+  const unsigned size = SymArraySize;
+  unsigned count = std::max(1U, (unsigned)SymTableCount);
+
+  ArrayType *variantType = ArrayType::get(i8_type, 2 * size);
+  ArrayType *tablesType = ArrayType::get(variantType, count);
+  if (!SymTables) {
+    std::vector<Constant *> variants;
+    for (unsigned v = 0; v < count; ++v) {
+      std::vector<uint8_t> arr1(size), arr2(size);
+      std::iota(arr1.begin(), arr1.end(), 0);
+      std::iota(arr2.begin(), arr2.end(), 0);
+      std::shuffle(arr1.begin(), arr1.end(), rng);
+      std::shuffle(arr2.begin(), arr2.end(), rng);
+      std::vector<Constant *> bytes;
+      for (uint8_t b : arr1)
+        bytes.push_back(ConstantInt::get(i8_type, b));
+      for (uint8_t b : arr2)
+        bytes.push_back(ConstantInt::get(i8_type, b));
+      variants.push_back(ConstantArray::get(variantType, bytes));
+    }
+    SymTables = new GlobalVariable(M, tablesType, false,
+                                   GlobalValue::InternalLinkage,
+                                   ConstantArray::get(tablesType, variants),
+                                   "bogus_sym_tables");
+    SymTables->setExternallyInitialized(true);
+    SymTables->setAlignment(toAlign(64));
+  }
+
+  // Pick the variant of this predicate
+  std::uniform_int_distribution<unsigned> pick(0, count - 1);
+  Value *variant = ConstantInt::get(i64_type, pick(rng));
+  Value *zero = ConstantInt::get(i64_type, 0);
+
+  Value *arg64 = Builder.CreateSExtOrBitCast(arg, i64_type, "load64");
+  Value *idx1 = Builder.CreateURem(arg64, ConstantInt::get(i64_type, size));
+  Value *load1 = Builder.CreateLoad(
+      i8_type, Builder.CreateInBoundsGEP(tablesType, SymTables,
+                                         {zero, variant, idx1}, "idx_1"));
+  Value *idx2 = Builder.CreateAdd(Builder.CreateZExt(load1, i64_type),
+                                  ConstantInt::get(i64_type, size));
+  Value *load2 = Builder.CreateLoad(
+      i8_type, Builder.CreateInBoundsGEP(tablesType, SymTables,
+                                         {zero, variant, idx2}, "idx_2"));
+
+  // Compare arr2[arr1[i]] with a value the arrays do not contain
+  return Builder.CreateICmpNE(load2, ConstantInt::get(i8_type, size),
+                              "ArrOpq");
+}
+
+// Based on https://github.com/hxuhack/symobfuscator-deprecated-
+Value *BogusFlowPass::getSymOP(Module &M, Instruction *inst, Value *arg) {
+  if (SymState == SymStateGlobal)
+    return getSymTableOP(M, inst, arg);
+
+  IRBuilder<> Builder(inst);
+  Type *argType = arg->getType();
+
+  unsigned size = SymArraySize;
+
+  const DataLayout &DL = M.getDataLayout();
+  ConstantInt *i0_32 = (ConstantInt *)ConstantInt::getSigned(
+      Type::getInt32Ty(M.getContext()), 0);
+  ConstantInt *size_i64 = dyn_cast<ConstantInt>(
+      ConstantInt::getSigned(Type::getInt64Ty(M.getContext()), size));
+
+  AllocaInst *arr_alloc1, *arr_alloc2;
+  Value *loadInst;
   Value *remInst;
+  if (SymState == SymStateEntry) {
+    // Allocas in the entry block are static, so the stack usage of the
+    // function does not depend on how many predicates it contains or how
+    // many times they are executed
+    if (!EntryArrays.first) {
+      Function *F = inst->getParent()->getParent();
+      EntryArrays =
+          createSymArrays(M, &*F->getEntryBlock().getFirstInsertionPt(), size);
+    }
+    std::tie(arr_alloc1, arr_alloc2) = EntryArrays;
+    loadInst = arg;
+  } else {
+    std::tie(arr_alloc1, arr_alloc2) = createSymArrays(M, inst, size);
+
+    Value *allocaInst = Builder.CreateAlloca(argType, DL.getAllocaAddrSpace(),
+                                             nullptr, "allocaInst");
+    Builder.CreateStore(arg, allocaInst);
+    loadInst = Builder.CreateLoad(argType, allocaInst, "loadInst");
+  }
+
+  // Remainder instruction
+  // Unsigned, so that negative arguments do not index before the arrays
   if (((IntegerType *)argType)->getBitWidth() != 64) {
     // Cast loadInst to i64
     Value *load64 = Builder.CreateSExtOrBitCast(
         loadInst, Type::getInt64Ty(M.getContext()), "load64");
-    remInst = Builder.CreateSRem(load64, size_i64);
+    remInst = Builder.CreateURem(load64, size_i64);
   } else {
-    remInst = Builder.CreateSRem(loadInst, size_i64);
+    remInst = Builder.CreateURem(loadInst, size_i64);
   }
 
   // Load GEPs
@@ -393,17 +1001,19 @@ Value *BogusFlowPass::getSymOP(Module &M, Instruction *inst, Value *arg) {
   vec1.push_back(i0_32);
   vec1.push_back(remInst);
   ArrayRef<Value *> arrRef1(vec1);
-  Value *gep1 =
-      Builder.CreateInBoundsGEP((Value *)arr_alloc1, arrRef1, "idx_1");
-  LoadInst *load1 = new LoadInst(gep1, "", false, inst);
+  Value *gep1 = Builder.CreateInBoundsGEP(arr_alloc1->getAllocatedType(),
+                                          arr_alloc1, arrRef1, "idx_1");
+  LoadInst *load1 = new LoadInst(Type::getInt64Ty(M.getContext()), gep1, "",
+                                 false, inst);
 
   std::vector<Value *> vec2;
   vec2.push_back(i0_32);
   vec2.push_back(load1);
   ArrayRef<Value *> arrRef2(vec2);
-  Value *gep2 =
-      Builder.CreateInBoundsGEP((Value *)arr_alloc2, arrRef2, "idx_2");
-  LoadInst *load2 = new LoadInst(gep2, "", false, inst);
+  Value *gep2 = Builder.CreateInBoundsGEP(arr_alloc2->getAllocatedType(),
+                                          arr_alloc2, arrRef2, "idx_2");
+  LoadInst *load2 = new LoadInst(Type::getInt64Ty(M.getContext()), gep2, "",
+                                 false, inst);
 
   // Compare arr1[i] == arr2[j]
   Value *res = Builder.CreateICmpNE(load2, size_i64, "ArrOpq");
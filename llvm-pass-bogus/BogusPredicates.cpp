@@ -0,0 +1,99 @@
+#include "BogusPredicates.h"
+
+using namespace llvm;
+
+namespace bogus {
+
+std::vector<OpaquePredicate> &predicateLibrary() {
+  static std::vector<OpaquePredicate> Library = {
+      {"7y^2 - 1 != x^2",
+       {{Instruction::Mul, false},
+        {Instruction::Mul, false},
+        {Instruction::Mul, true},
+        {Instruction::Sub, true},
+        {Instruction::ICmp, false}},
+       [](IRBuilder<> &Builder, Value *x, Value *y) {
+         Type *Ty = x->getType();
+         return Builder.CreateICmpNE(
+             Builder.CreateSub(
+                 Builder.CreateMul(ConstantInt::get(Ty, 7),
+                                   Builder.CreateMul(y, y)),
+                 ConstantInt::get(Ty, 1)),
+             Builder.CreateMul(x, x));
+       }},
+      {"(x^2 + 1) % 7 != 0",
+       {{Instruction::Mul, false},
+        {Instruction::Add, true},
+        {Instruction::SRem, true},
+        {Instruction::ICmp, false}},
+       [](IRBuilder<> &Builder, Value *x, Value *) {
+         Type *Ty = x->getType();
+         return Builder.CreateICmpNE(
+             Builder.CreateSRem(Builder.CreateAdd(Builder.CreateMul(x, x),
+                                                  ConstantInt::get(Ty, 1)),
+                                ConstantInt::get(Ty, 7)),
+             ConstantInt::get(Ty, 0));
+       }},
+      {"(x^2 + x + 7) % 81 != 0",
+       {{Instruction::Mul, false},
+        {Instruction::Add, false},
+        {Instruction::Add, true},
+        {Instruction::SRem, true},
+        {Instruction::ICmp, false}},
+       [](IRBuilder<> &Builder, Value *x, Value *) {
+         Type *Ty = x->getType();
+         return Builder.CreateICmpNE(
+             Builder.CreateSRem(
+                 Builder.CreateAdd(
+                     Builder.CreateAdd(Builder.CreateMul(x, x), x),
+                     ConstantInt::get(Ty, 7)),
+                 ConstantInt::get(Ty, 81)),
+             ConstantInt::get(Ty, 0));
+       }},
+      {"(4x^2 + 4) % 19 != 0",
+       {{Instruction::Mul, false},
+        {Instruction::Mul, true},
+        {Instruction::Add, true},
+        {Instruction::SRem, true},
+        {Instruction::ICmp, false}},
+       [](IRBuilder<> &Builder, Value *x, Value *) {
+         Type *Ty = x->getType();
+         return Builder.CreateICmpNE(
+             Builder.CreateSRem(
+                 Builder.CreateAdd(
+                     Builder.CreateMul(Builder.CreateMul(x, x),
+                                       ConstantInt::get(Ty, 4)),
+                     ConstantInt::get(Ty, 4)),
+                 ConstantInt::get(Ty, 19)),
+             ConstantInt::get(Ty, 0));
+       }},
+      {"x(x + 1) & 1 == 0",
+       {{Instruction::Add, true},
+        {Instruction::Mul, false},
+        {Instruction::And, true},
+        {Instruction::ICmp, false}},
+       [](IRBuilder<> &Builder, Value *x, Value *) {
+         Type *Ty = x->getType();
+         return Builder.CreateICmpEQ(
+             Builder.CreateAnd(
+                 Builder.CreateMul(x,
+                                   Builder.CreateAdd(x, ConstantInt::get(Ty, 1))),
+                 ConstantInt::get(Ty, 1)),
+             ConstantInt::get(Ty, 0));
+       }},
+      {"x^2 & 3 != 2",
+       {{Instruction::Mul, false},
+        {Instruction::And, true},
+        {Instruction::ICmp, false}},
+       [](IRBuilder<> &Builder, Value *x, Value *) {
+         Type *Ty = x->getType();
+         return Builder.CreateICmpNE(
+             Builder.CreateAnd(Builder.CreateMul(x, x),
+                               ConstantInt::get(Ty, 3)),
+             ConstantInt::get(Ty, 2));
+       }},
+  };
+  return Library;
+}
+
+} // namespace bogus
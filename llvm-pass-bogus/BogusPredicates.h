@@ -0,0 +1,47 @@
+// Opaque predicates of the bogus flow pass
+//
+// Shared by the pass and by PredicateHeader, which prints them as C for the
+// micro-benchmark of testing/predicates, so the benchmark measures the
+// predicates the pass emits.
+#ifndef OBF_BOGUS_PREDICATES_H
+#define OBF_BOGUS_PREDICATES_H
+
+#include <vector>
+
+#include "llvm/IR/IRBuilder.h"
+
+namespace bogus {
+
+/* Opaque predicate library
+ *
+ * Each predicate used by getSimpleOP lists the instructions it emits, so
+ * that its cost on the target can be estimated with TargetTransformInfo,
+ * and builds the always true condition from two i32 operands in the range
+ * [-126, 126]. New predicates only need to be added to the library.
+ */
+struct PredicateOp {
+  unsigned Opcode;
+  bool ConstOperand; // the second operand is a constant
+  bool PowerOf2;     // the constant is a power of 2
+  unsigned SrcBits;  // width of the operand of a cast
+  PredicateOp(unsigned Opcode, bool ConstOperand, bool PowerOf2 = false,
+              unsigned SrcBits = 0)
+      : Opcode(Opcode), ConstOperand(ConstOperand), PowerOf2(PowerOf2),
+        SrcBits(SrcBits) {}
+};
+
+struct OpaquePredicate {
+  const char *Name;
+  std::vector<PredicateOp> Ops;
+  llvm::Value *(*Build)(llvm::IRBuilder<> &Builder, llvm::Value *x,
+                        llvm::Value *y);
+};
+
+std::vector<OpaquePredicate> &predicateLibrary();
+
+// Number of elements of each array of the symbolic predicates
+const unsigned SymArraySize = 8;
+
+} // namespace bogus
+
+#endif
@@ -0,0 +1,127 @@
+// Prints the opaque predicates of the bogus flow pass as a C header, for
+// the micro-benchmark of testing/predicates.
+//
+// Every predicate of the library is built on two i32 arguments and printed
+// back from the instructions it emits, as an X macro:
+//   PREDICATES(P) expands to P(id, name, expression) for each predicate
+// The expressions use x and y, which the benchmark declares, and SQUARE(v)
+// for v * v, which the benchmark hides from the C compiler the same way
+// LLVM does not know the squares modulo 4. SYM_SIZE is the number of
+// elements of the arrays of the symbolic predicates.
+//
+// usage: PredicateHeader > predicates.h
+#include <cstdio>
+#include <string>
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include "BogusPredicates.h"
+
+using namespace llvm;
+using namespace bogus;
+
+namespace {
+
+const char *getOperator(const Instruction &I) {
+  switch (I.getOpcode()) {
+  case Instruction::Add:
+    return "+";
+  case Instruction::Sub:
+    return "-";
+  case Instruction::Mul:
+    return "*";
+  case Instruction::SRem:
+    return "%";
+  case Instruction::And:
+    return "&";
+  case Instruction::Or:
+    return "|";
+  case Instruction::Xor:
+    return "^";
+  case Instruction::ICmp:
+    switch (cast<ICmpInst>(I).getPredicate()) {
+    case ICmpInst::ICMP_EQ:
+      return "==";
+    case ICmpInst::ICMP_NE:
+      return "!=";
+    case ICmpInst::ICMP_SLT:
+      return "<";
+    case ICmpInst::ICMP_SLE:
+      return "<=";
+    case ICmpInst::ICMP_SGT:
+      return ">";
+    case ICmpInst::ICMP_SGE:
+      return ">=";
+    default:
+      return nullptr;
+    }
+  default:
+    return nullptr;
+  }
+}
+
+// V as a C expression of int32_t x and y. The operands are in the range
+// [-126, 126], where none of the predicates overflows an int32_t, so the
+// operators of C compute the same values as the instructions
+bool printExpr(Value *V, Value *X, Value *Y, std::string &Out) {
+  if (V == X || V == Y) {
+    Out += V == X ? "x" : "y";
+    return true;
+  }
+  if (auto *C = dyn_cast<ConstantInt>(V)) {
+    Out += std::to_string(C->getSExtValue());
+    return true;
+  }
+  auto *I = dyn_cast<Instruction>(V);
+  const char *Op = I ? getOperator(*I) : nullptr;
+  if (!Op)
+    return false;
+  if (I->getOpcode() == Instruction::Mul &&
+      I->getOperand(0) == I->getOperand(1)) {
+    Out += "SQUARE(";
+    bool Printed = printExpr(I->getOperand(0), X, Y, Out);
+    Out += ")";
+    return Printed;
+  }
+  Out += "(";
+  if (!printExpr(I->getOperand(0), X, Y, Out))
+    return false;
+  Out += std::string(" ") + Op + " ";
+  if (!printExpr(I->getOperand(1), X, Y, Out))
+    return false;
+  Out += ")";
+  return true;
+}
+
+} // namespace
+
+int main() {
+  LLVMContext Ctx;
+  Module M("predicates", Ctx);
+  Type *I32 = Type::getInt32Ty(Ctx);
+
+  printf("// Generated by PredicateHeader from "
+         "llvm-pass-bogus/BogusPredicates.cpp, do not edit\n");
+  printf("#define SYM_SIZE %u\n\n", SymArraySize);
+  printf("#define PREDICATES(P)");
+  unsigned Id = 0;
+  for (OpaquePredicate &Pred : predicateLibrary()) {
+    Function *F =
+        Function::Create(FunctionType::get(I32, {I32, I32}, false),
+                         GlobalValue::ExternalLinkage, "p" + Twine(Id), &M);
+    IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+    Value *X = F->getArg(0);
+    Value *Y = F->getArg(1);
+    std::string Expr;
+    if (!printExpr(Pred.Build(B, X, Y), X, Y, Expr)) {
+      fprintf(stderr, "PredicateHeader: cannot print %s\n", Pred.Name);
+      return 1;
+    }
+    printf(" \\\n  P(%u, \"%s\", %s)", Id++, Pred.Name, Expr.c_str());
+  }
+  printf("\n");
+  return 0;
+}
@@ -1,368 +1,356 @@
-#define DEBUG_TYPE "mba"
-
 #include <random>
 
-// TODO build LLVM with stats enabled and try this
 #include "llvm/ADT/Statistic.h"
-STATISTIC(MBACount, "The number of substituted instructions with MBA");
-
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/RandomNumberGenerator.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
+#include "MbaLinear.h"
+#include "MbaRules.h"
+
 using namespace llvm;
+using namespace mba;
+
+#define DEBUG_TYPE "mba"
+
+STATISTIC(MBACount, "The number of substituted instructions with MBA");
+STATISTIC(LayerCount, "The number of substitutions in layers below the first");
+STATISTIC(EmittedCount, "The number of instructions emitted by MBA rules");
+STATISTIC(SharedCount, "The number of values reused instead of emitted");
+STATISTIC(LinearCount, "The number of substitutions with generated identities");
+
+enum RuleSelectKind { SelectWeight, SelectCost };
 
 static cl::opt<int> ObfProb(
     "sub_prob",
     cl::desc("Choose the probability of obfuscating a binary operation"),
     cl::value_desc("probability"), cl::init(100), cl::Optional);
 
+static cl::opt<RuleSelectKind> RuleSelect(
+    "sub_select",
+    cl::desc("Choose how the identity of each substitution is picked"),
+    cl::values(clEnumValN(SelectWeight, "weight",
+                          "At random, in proportion to the rule weights"),
+               clEnumValN(SelectCost, "cost",
+                          "At random, in proportion to the rule weights "
+                          "divided by the number of instructions the rules "
+                          "emit")),
+    cl::init(SelectWeight), cl::Optional);
+
+static cl::opt<unsigned> MaxDepth(
+    "sub_depth",
+    cl::desc("Substitute the operations of the emitted expressions again, "
+             "up to this number of layers"),
+    cl::value_desc("layers"), cl::init(1), cl::Optional);
+
+static cl::opt<unsigned> InstBudget(
+    "sub_inst_budget",
+    cl::desc("Number of instructions the layers may add for one substituted "
+             "operation (0 = no limit)"),
+    cl::value_desc("instructions"), cl::init(0), cl::Optional);
+
+static cl::opt<unsigned> FuncBudget(
+    "sub_func_budget",
+    cl::desc("Stop substituting once a function reaches this percentage of "
+             "its original instruction count (0 = no limit)"),
+    cl::value_desc("percent"), cl::init(0), cl::Optional);
+
+static cl::opt<bool> ShareExprs(
+    "sub_share",
+    cl::desc("Reuse the values (~x, x | y, x & y...) already emitted in the "
+             "block instead of emitting them again"),
+    cl::init(true), cl::Optional);
+
+static cl::opt<unsigned> HotCost(
+    "sub_hot_cost",
+    cl::desc("In the blocks that run more than once per call of their "
+             "function, only use the rules whose estimated cost is at most "
+             "this (0 = no limit)"),
+    cl::value_desc("cost"), cl::init(0), cl::Optional);
+
+static cl::opt<int> LinearProb(
+    "sub_linear",
+    cl::desc("Choose the probability of substituting an add, sub, and, or or "
+             "xor with a freshly generated linear MBA instead of a rule of "
+             "the table"),
+    cl::value_desc("probability"), cl::init(0), cl::Optional);
+
+static cl::opt<unsigned> LinearCost(
+    "sub_linear_cost",
+    cl::desc("Largest estimated cost of a generated linear MBA, as a "
+             "multiple of the replaced operation (0 = no limit)"),
+    cl::value_desc("multiple"), cl::init(24), cl::Optional);
+
+static cl::opt<bool> HotScale(
+    "sub_hot",
+    cl::desc("Divide the probability of obfuscating a binary operation by "
+             "the number of times its block runs per call of the function"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<bool> VectorOps(
+    "sub_vector",
+    cl::desc("Also substitute operations on vectors of integers, lane-wise"),
+    cl::init(true), cl::Optional);
+
+static cl::opt<bool> AfterVectorize(
+    "mba_after_vectorize",
+    cl::desc("When the pass is loaded in clang or in opt -O<n>, run it at the "
+             "end of the pipeline, after the loop vectorizer"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<bool> Report(
+    "sub_report",
+    cl::desc("Print the number of substitutions and the expected number of "
+             "added instructions per call of each function"),
+    cl::init(false), cl::Optional);
+
 namespace {
-struct MbaPass : public BasicBlockPass {
+struct MbaPass : public FunctionPass {
 
   static char ID;
+  // Substitutions in the current function, and the instructions they add
+  // to one call of the function
+  unsigned Substituted = 0;
+  double Overhead = 0;
+  // Instruction count of the current function, and the limit set by
+  // -sub_func_budget (0 = none)
+  unsigned FuncSize = 0;
+  unsigned FuncLimit = 0;
+  // Values emitted by the substitutions of the current block
+  ExprMemo BlockMemo;
+  // The last identity generated by -sub_linear, and its text
+  Rule Linear;
+  std::string LinearExpr;
+  OptimizationRemarkEmitter *ORE = nullptr;
+
+  MbaPass() : FunctionPass(ID) {}
+
+  // Pick one of the rules replacing I that hold for its width and cost at
+  // most MaxCost (0 = no limit), or nullptr if there are none
+  const Rule *pickRule(Instruction *I, unsigned MaxCost, std::mt19937 &rng) {
+    const std::vector<const Rule *> &Rules = getRules(I);
+    unsigned Bits = I->getOperand(0)->getType()->getScalarSizeInBits();
+    auto Usable = [&](const Rule *R) {
+      return Bits >= R->MinBits && (!MaxCost || R->Cost <= MaxCost);
+    };
+    double Total = 0;
+    for (const Rule *R : Rules)
+      if (Usable(R))
+        Total += ruleWeight(*R);
+    if (Total == 0)
+      return nullptr;
+    double Pick = std::uniform_real_distribution<double>(0, Total)(rng);
+    const Rule *Last = nullptr;
+    for (const Rule *R : Rules) {
+      if (!Usable(R))
+        continue;
+      Last = R;
+      Pick -= ruleWeight(*R);
+      if (Pick < 0)
+        return R;
+    }
+    return Last;
+  }
+
+  // Integer operations with rules. The identities hold lane-wise, so
+  // vectors of integers work the same way and stay vectors
+  static bool isCandidate(Instruction *I) {
+    if (getRules(I).empty())
+      return false;
+    Type *Ty = I->getOperand(0)->getType();
+    return Ty->isIntegerTy() || (VectorOps && Ty->isIntOrIntVectorTy());
+  }
+
+  static double ruleWeight(const Rule &R) {
+    if (RuleSelect == SelectCost)
+      return (double)R.Weight / std::max(R.Cost, 1u);
+    return R.Weight;
+  }
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+    AU.setPreservesCFG();
+  }
+
+  virtual bool runOnFunction(Function &F) {
+    BlockFrequencyInfo &BFI =
+        getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    ORE = &getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+    uint64_t EntryFreq = BFI.getEntryFreq();
+    bool changed = false;
+    Substituted = 0;
+    Overhead = 0;
+    unsigned SizeBefore = F.getInstructionCount();
+    FuncSize = SizeBefore;
+    FuncLimit = (uint64_t)SizeBefore * FuncBudget / 100;
+
+    for (BasicBlock &BB : F) {
+      // Number of times the block runs per call of the function
+      double Execs =
+          EntryFreq ? (double)BFI.getBlockFreq(&BB).getFrequency() / EntryFreq
+                    : 1;
+      double Prob = ObfProb;
+      if (HotScale && Execs > 1)
+        Prob /= Execs;
+      changed |= runOnBasicBlock(BB, Prob, Execs);
+    }
+
+    if (Report) {
+      errs() << "mba: " << F.getName() << ": " << Substituted
+             << " substitutions, " << format("%.1f", Overhead)
+             << " added instructions per call, expansion "
+             << format("%.2f", SizeBefore ? (double)FuncSize / SizeBefore : 1)
+             << "x\n";
+    }
+    return changed;
+  } // runOnFunction
 
-  MbaPass() : BasicBlockPass(ID) {}
-
-  Value *SubAdd(BinaryOperator *BinOp);
-  Value *SubAdd2(BinaryOperator *BinOp);
-  Value *SubAdd3(BinaryOperator *BinOp);
-
-  Value *SubSub(BinaryOperator *BinOp);
-  Value *SubSub2(BinaryOperator *BinOp);
-  Value *SubSub3(BinaryOperator *BinOp);
-
-  Value *SubXor(BinaryOperator *BinOp);
-  Value *SubXor2(BinaryOperator *BinOp);
-  Value *SubXor3(BinaryOperator *BinOp);
-
-  Value *SubAnd(BinaryOperator *BinOp);
-  Value *SubAnd2(BinaryOperator *BinOp);
-  Value *SubAnd3(BinaryOperator *BinOp);
-
-  Value *SubOr(BinaryOperator *BinOp);
-  Value *SubOr2(BinaryOperator *BinOp);
-  Value *SubOr3(BinaryOperator *BinOp);
-
-  virtual bool runOnBasicBlock(BasicBlock &BB) {
-    // auto rng = BB.getParent()->getParent()->createRNG(this);
+  bool runOnBasicBlock(BasicBlock &BB, double Prob, double Execs) {
     std::random_device dev;
     std::mt19937 rng(dev());
-    std::uniform_int_distribution<std::mt19937::result_type> dist(0, 2);
+    std::uniform_real_distribution<double> percent(0, 100);
+    BlockMemo.clear();
 
-    bool changed = false;
-    for (auto current = BB.begin(), last = BB.end(); current != last;
-         current++) {
-      Instruction &Inst = *current;
-      // Check if the instruction is a BinaryOperator type
-      auto *BinOp = dyn_cast<BinaryOperator>(&Inst);
-      // If not, skip it
-      if (!BinOp)
-        continue;
+    // Collect the candidates first, substituting an instruction moves the
+    // iterator past the next one
+    std::vector<Instruction *> Candidates;
+    for (Instruction &Inst : BB)
+      if (isCandidate(&Inst))
+        Candidates.push_back(&Inst);
 
-      // Maybe insert probability of replacement (condition) here
+    // Keep the expensive rules out of loops
+    unsigned MaxCost = Execs > 1 ? HotCost : 0;
 
-      unsigned Opcode = BinOp->getOpcode();
-      // Substitute only integer operations
-      if (!BinOp->getType()->isIntegerTy())
+    bool changed = false;
+    for (Instruction *Inst : Candidates) {
+      if (percent(rng) >= Prob)
         continue;
 
-      int randNum = dist(rng);
-      switch (Opcode) {
-      case Instruction::Add:
-        switch (randNum) {
-        case 0:
-          ReplaceInstWithValue(BB.getInstList(), current, SubAdd(BinOp));
-          break;
-        case 1:
-          ReplaceInstWithValue(BB.getInstList(), current, SubAdd2(BinOp));
-          break;
-        case 2:
-          ReplaceInstWithValue(BB.getInstList(), current, SubAdd3(BinOp));
-          break;
-        }
-        ++MBACount;
-        changed = true;
-        break;
-      case Instruction::Sub:
-        switch (randNum) {
-        case 0:
-          errs() << "Using SubSub" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubSub(BinOp));
-          break;
-        case 1:
-          errs() << "Using SubSub2" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubSub2(BinOp));
-          break;
-        case 2:
-          errs() << "Using SubSub3" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubSub3(BinOp));
-          break;
-        }
-        ++MBACount;
-        changed = true;
-        break;
-      case Instruction::Xor:
-        switch (randNum) {
-        case 0:
-          errs() << "Using SubXor" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubXor(BinOp));
-          break;
-        case 1:
-          errs() << "Using SubXor2" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubXor2(BinOp));
-          break;
-        case 2:
-          errs() << "Using SubXor3" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubXor3(BinOp));
-          break;
-        }
-        ++MBACount;
-        changed = true;
-        break;
-      case Instruction::And:
-        switch (randNum) {
-        case 0:
-          errs() << "Using SubAnd" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubAnd(BinOp));
-          break;
-        case 1:
-          errs() << "Using SubAnd2" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubAnd2(BinOp));
-          break;
-        case 2:
-          errs() << "Using SubAnd3" << '\n';
-          ReplaceInstWithValue(BB.getInstList(), current, SubAnd3(BinOp));
-          break;
-        }
-        ++MBACount;
-        changed = true;
-        break;
-      case Instruction::Or:
-        switch (randNum) {
-        case 0:
-          ReplaceInstWithValue(BB.getInstList(), current, SubOr(BinOp));
-          break;
-        case 1:
-          ReplaceInstWithValue(BB.getInstList(), current, SubOr2(BinOp));
-          break;
-        case 2:
-          ReplaceInstWithValue(BB.getInstList(), current, SubOr3(BinOp));
-          break;
-        }
-        ++MBACount;
-        changed = true;
-        break;
-      default:
+      int Grown = 0;
+      if (!substitute(Inst, MaxCost, rng, Grown))
         continue;
-      }
+      changed = true;
+      ++Substituted;
+      Overhead += Execs * Grown;
 
     } // for loop
     return changed;
   } // runOnBasicBlock
-};  // MbaPass
-
-} // namespace
-
-// Substitute x + y --> 2*(x | y) - (x ^ y)
-Value *MbaPass::SubAdd(BinaryOperator *BinOp) {
-  errs() << "Using SubAdd: x + y --> 2*(x | y) - (x ^ y)" << '\n';
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateMul(
-          ConstantInt::get(BinOp->getType(), 2),
-          Builder.CreateOr(BinOp->getOperand(0), BinOp->getOperand(1))),
-      Builder.CreateXor(BinOp->getOperand(0), BinOp->getOperand(1)));
-  return NewValue;
-}
-
-// Substitute x + y --> (x^(~y)) + 2*(x|y) + 1
-Value *MbaPass::SubAdd2(BinaryOperator *BinOp) {
-  errs() << "Using SubAdd2: x + y --> (x^(~y)) + 2*(x|y) + 1" << '\n';
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateAdd(
-      Builder.CreateXor(BinOp->getOperand(0),
-                        Builder.CreateNot(BinOp->getOperand(1))),
-      Builder.CreateMul(
-          ConstantInt::get(BinOp->getType(), 2),
-          Builder.CreateOr(BinOp->getOperand(0), BinOp->getOperand(1))));
-  NewValue = Builder.CreateAdd(NewValue, ConstantInt::get(BinOp->getType(), 1));
-  return NewValue;
-}
-
-// Substitute x + y --> (x^y) + 2y − 2*(~x & y)
-Value *MbaPass::SubAdd3(BinaryOperator *BinOp) {
-  errs() << "Using SubAdd3: x + y --> (x^y) + 2y − 2*(~x & y)\n";
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateAdd(
-          Builder.CreateXor(BinOp->getOperand(0), BinOp->getOperand(1)),
-          Builder.CreateMul(ConstantInt::get(BinOp->getType(), 2),
-                            BinOp->getOperand(1))),
-      Builder.CreateMul(
-          ConstantInt::get(BinOp->getType(), 2),
-          Builder.CreateAnd(Builder.CreateNot(BinOp->getOperand(0)),
-                            BinOp->getOperand(1))));
-  return NewValue;
-}
 
-// Substitute x - y --> 2*(x & ~y) - (x ^ y)
-Value *MbaPass::SubSub(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateMul(
-          ConstantInt::get(BinOp->getType(), 2),
-          Builder.CreateAnd(BinOp->getOperand(0),
-                            Builder.CreateNot(BinOp->getOperand(1)))),
-      Builder.CreateXor(BinOp->getOperand(0), BinOp->getOperand(1)));
-  return NewValue;
-}
-
-// Substitute x - y --> ~(~x + y) & ~(~x + y) (from VMProtect)
-Value *MbaPass::SubSub2(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateAnd(
-      Builder.CreateNeg(Builder.CreateAdd(
-          Builder.CreateNeg(BinOp->getOperand(0)), BinOp->getOperand(1))),
-      Builder.CreateNeg(Builder.CreateAdd(
-          Builder.CreateNeg(BinOp->getOperand(0)), BinOp->getOperand(1))));
-  return NewValue;
-}
-
-// Substitite x - y --> x & ~y - ~x & y (Tigress)
-Value *MbaPass::SubSub3(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateAnd(BinOp->getOperand(0),
-                        Builder.CreateNot(BinOp->getOperand(1))),
-      Builder.CreateAnd(Builder.CreateNot(BinOp->getOperand(0)),
-                        BinOp->getOperand(1)));
-  return NewValue;
-}
-
-// Substitute x ^ y --> (x | y) - (x & y)
-Value *MbaPass::SubXor(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateOr(BinOp->getOperand(0), BinOp->getOperand(1)),
-      Builder.CreateAnd(BinOp->getOperand(0), BinOp->getOperand(1)));
-  return NewValue;
-}
-
-// Substitute x ^ y --> (x | y) − y + (~x & y)
-Value *MbaPass::SubXor2(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateAdd(
-      Builder.CreateSub(
-          Builder.CreateOr(BinOp->getOperand(0), BinOp->getOperand(1)),
-          BinOp->getOperand(1)),
-      Builder.CreateAnd(Builder.CreateNot(BinOp->getOperand(0)),
-                        BinOp->getOperand(1)));
-  return NewValue;
-}
-
-// Substitute x ^ y --> (x | y) − (~x | y) + (~x)
-Value *MbaPass::SubXor3(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateAdd(
-      Builder.CreateSub(
-          Builder.CreateOr(BinOp->getOperand(0), BinOp->getOperand(1)),
-          Builder.CreateOr(Builder.CreateNot(BinOp->getOperand(0)),
-                           BinOp->getOperand(1))),
-      Builder.CreateNot(BinOp->getOperand(0)));
-  return NewValue;
-}
-
-// Substitute x & y --> (~x | y) - ~x
-Value *MbaPass::SubAnd(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateOr(Builder.CreateNot(BinOp->getOperand(0)),
-                       BinOp->getOperand(1)),
-      Builder.CreateNot(BinOp->getOperand(0)));
-  return NewValue;
-}
-
-// Substitute x & y --> (x | y) − (~x & y) − (x & ~y)
-Value *MbaPass::SubAnd2(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateSub(
-          Builder.CreateOr(BinOp->getOperand(0), BinOp->getOperand(1)),
-          Builder.CreateAnd(Builder.CreateNot(BinOp->getOperand(0)),
-                            BinOp->getOperand(1))),
-      Builder.CreateAnd(BinOp->getOperand(0),
-                        Builder.CreateNot(BinOp->getOperand(1))));
-  return NewValue;
-}
-
-// Substitute x & y --> -(x ^ y) + y + (x & ~y)
-Value *MbaPass::SubAnd3(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateAdd(
-      Builder.CreateAdd(Builder.CreateNeg(Builder.CreateXor(
-                            BinOp->getOperand(0), BinOp->getOperand(1))),
-                        BinOp->getOperand(1)),
-      Builder.CreateAnd(BinOp->getOperand(0),
-                        Builder.CreateNot(BinOp->getOperand(1))));
-  return NewValue;
-}
+  // Substitute Root, then the operations of the emitted expressions, layer
+  // by layer, until -sub_depth or a budget is reached. Grown is set to the
+  // number of instructions added for Root
+  bool substitute(Instruction *Root, unsigned MaxCost, std::mt19937 &rng,
+                  int &Grown) {
+    SmallVector<std::pair<Instruction *, unsigned>, 16> Worklist;
+    Worklist.push_back({Root, 1});
+    Grown = 0;
+    bool changed = false;
 
-// Substitute x | y --> (x & ~y) + y
-Value *MbaPass::SubOr(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateAdd(
-      Builder.CreateAnd(BinOp->getOperand(0),
-                        Builder.CreateNot(BinOp->getOperand(1))),
-      BinOp->getOperand(1));
-  return NewValue;
-}
+    for (size_t I = 0; I < Worklist.size(); ++I) {
+      Instruction *Inst = Worklist[I].first;
+      unsigned Depth = Worklist[I].second;
+      const Rule *R = nullptr;
+      if (LinearProb && hasLinearRules(Inst) &&
+          std::uniform_int_distribution<int>(0, 99)(rng) < LinearProb) {
+        // 0 is no limit for both, the smaller of the two limits applies
+        unsigned Cost = LinearCost;
+        if (MaxCost && (!Cost || MaxCost < Cost))
+          Cost = MaxCost;
+        if (makeLinearRule(Inst->getOpcode(), Cost, rng, Linear, LinearExpr))
+          R = &Linear;
+      }
+      if (!R)
+        R = pickRule(Inst, MaxCost, rng);
+      if (!R)
+        continue;
+      // The rule replaces one instruction
+      unsigned Growth = R->Size - 1;
+      if (InstBudget && Grown + (int)Growth > (int)InstBudget)
+        continue;
+      if (FuncLimit && FuncSize + Growth > FuncLimit)
+        continue;
 
-// Substitute x | y --> (x^y) + y − (~x & y)
-Value *MbaPass::SubOr2(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateAdd(
-          Builder.CreateXor(BinOp->getOperand(0), BinOp->getOperand(1)),
-          BinOp->getOperand(1)),
-      Builder.CreateAnd(Builder.CreateNot(BinOp->getOperand(0)),
-                        BinOp->getOperand(1)));
-  return NewValue;
-}
+      // Built only when -pass-remarks=mba or a remarks file asks for it
+      ORE->emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Substituted", Inst)
+               << "substituted " << ore::NV("Pattern", R->Pattern)
+               << " with " << ore::NV("Rule", R->Name) << ": "
+               << ore::NV("Expr", R->Expr) << " at depth "
+               << ore::NV("Depth", Depth);
+      });
+      // The layers insert their expressions before the values emitted for
+      // Root, which the block memo may already hold: they only share
+      // values within one rule
+      ExprMemo LayerMemo;
+      ExprMemo *Memo = nullptr;
+      if (ShareExprs) {
+        Memo = Depth == 1 ? &BlockMemo : &LayerMemo;
+        if (Depth > 1)
+          forgetExpr(BlockMemo, Inst);
+      }
+      SmallVector<Instruction *, 16> Emitted;
+      IRBuilder<> Builder(Inst);
+      Value *NewValue =
+          emitRule(*R, Builder, getOperands(Inst), &Emitted, Memo);
+      BasicBlock::iterator Current = Inst->getIterator();
+      ReplaceInstWithValue(Inst->getParent()->getInstList(), Current,
+                           NewValue);
+      ++MBACount;
+      if (Depth > 1)
+        ++LayerCount;
+      if (R == &Linear)
+        ++LinearCount;
+      EmittedCount += Emitted.size();
+      SharedCount += R->Size - Emitted.size();
+      changed = true;
+      // Emitted is empty when the whole expression was already in the
+      // block
+      Grown += (int)Emitted.size() - 1;
+      FuncSize = FuncSize + Emitted.size() - 1;
+
+      if (Depth >= MaxDepth)
+        continue;
+      // Operations with a constant operand (the negations, nots, masks and
+      // multiplications by 2 of the rules) would fold back at the first
+      // InstCombine, the next layer leaves them alone
+      for (Instruction *Op : Emitted) {
+        if (!isCandidate(Op))
+          continue;
+        SmallVector<Value *, 3> Ops = getOperands(Op);
+        if (std::none_of(Ops.begin(), Ops.end(),
+                         [](Value *V) { return isa<Constant>(V); }))
+          Worklist.push_back({Op, Depth + 1});
+      }
+    }
+    return changed;
+  }
+};  // MbaPass
 
-// Substitute x | y --> (x ^ y) + (~x | y) − (~x)
-Value *MbaPass::SubOr3(BinaryOperator *BinOp) {
-  Value *NewValue;
-  IRBuilder<> Builder(BinOp);
-  NewValue = Builder.CreateSub(
-      Builder.CreateAdd(
-          Builder.CreateXor(BinOp->getOperand(0), BinOp->getOperand(1)),
-          Builder.CreateOr(Builder.CreateNot(BinOp->getOperand(0)),
-                           BinOp->getOperand(1))),
-      Builder.CreateNot(BinOp->getOperand(0)));
-  return NewValue;
-}
+} // namespace
 
 char MbaPass::ID = 0;
 
 // Register the pass
 static RegisterPass<MbaPass> X("mba", "Substitute binary operations with MBA");
+
+// Run after the loop vectorizer, so that it still sees plain operations and
+// the vector operations it creates get substituted too
+static void registerMbaPass(const PassManagerBuilder &,
+                            legacy::PassManagerBase &PM) {
+  if (AfterVectorize)
+    PM.add(new MbaPass());
+}
+static RegisterStandardPasses
+    RegisterMbaLast(PassManagerBuilder::EP_OptimizerLast, registerMbaPass);
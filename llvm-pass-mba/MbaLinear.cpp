@@ -0,0 +1,247 @@
+#include "MbaLinear.h"
+
+#include <algorithm>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MathExtras.h"
+
+using namespace llvm;
+
+namespace mba {
+
+namespace {
+
+// Truth tables of the bitwise expressions: bit 2 * x + y holds the value of
+// the expression on the bits x and y
+const unsigned TableCount = 16;
+const unsigned MinusOne = 15;
+
+// Bitwise expressions with each truth table, one is picked at random for
+// every term. -1 is written as the term 1 with the opposite coefficient
+const char *const TableExprs[TableCount][3] = {
+    {nullptr},
+    {"~(x | y)", "~x & ~y"},
+    {"~x & y", "(x | y) ^ x", "y & ~(x & y)"},
+    {"~x"},
+    {"x & ~y", "(x | y) ^ y", "x ^ (x & y)"},
+    {"~y"},
+    {"x ^ y", "(x | y) & ~(x & y)", "(x & ~y) | (~x & y)"},
+    {"~(x & y)", "~x | ~y"},
+    {"x & y", "~(~x | ~y)", "(x | y) ^ (x ^ y)"},
+    {"~(x ^ y)", "x ^ ~y", "(x & y) | ~(x | y)"},
+    {"y"},
+    {"~x | y", "~(x & ~y)"},
+    {"x"},
+    {"x | ~y", "~(~x & y)"},
+    {"x | y", "(x ^ y) | (x & y)", "x ^ (~x & y)"},
+    {"1"}};
+
+struct TableExpr {
+  const char *Text;
+  std::vector<Step> Code;
+};
+
+const std::vector<TableExpr> &getTableExprs(unsigned Table) {
+  static const std::vector<std::vector<TableExpr>> Exprs = [] {
+    std::vector<std::vector<TableExpr>> Exprs(TableCount);
+    for (unsigned T = 1; T < TableCount; ++T)
+      for (const char *Text : TableExprs[T])
+        if (Text) {
+          Exprs[T].push_back({Text, {}});
+          parseExpr("Linear", Text, Exprs[T].back().Code);
+        }
+    return Exprs;
+  }();
+  return Exprs[Table];
+}
+
+// Four truth tables whose matrix has determinant +-1, and the inverse of
+// the matrix, in integers
+struct Basis {
+  unsigned Tables[4];
+  int64_t Inverse[4][4];
+};
+
+// Determinant of the submatrix of M on the rows and columns in the masks
+int64_t getMinor(const int64_t M[4][4], unsigned Rows, unsigned Cols) {
+  if (!Rows)
+    return 1;
+  unsigned Row = countTrailingZeros(Rows);
+  int64_t Det = 0;
+  int64_t Sign = 1;
+  for (unsigned Col = 0; Col < 4; ++Col) {
+    if (!(Cols & 1u << Col))
+      continue;
+    Det += Sign * M[Row][Col] *
+           getMinor(M, Rows & ~(1u << Row), Cols & ~(1u << Col));
+    Sign = -Sign;
+  }
+  return Det;
+}
+
+const std::vector<Basis> &getBases() {
+  static const std::vector<Basis> Bases = [] {
+    std::vector<Basis> Bases;
+    for (unsigned A = 1; A < TableCount; ++A)
+      for (unsigned B = A + 1; B < TableCount; ++B)
+        for (unsigned C = B + 1; C < TableCount; ++C)
+          for (unsigned D = C + 1; D < TableCount; ++D) {
+            Basis Base{{A, B, C, D}, {}};
+            // Column K holds the truth table of term K
+            int64_t M[4][4];
+            for (unsigned Row = 0; Row < 4; ++Row)
+              for (unsigned K = 0; K < 4; ++K)
+                M[Row][K] = Base.Tables[K] >> Row & 1;
+            int64_t Det = getMinor(M, 15, 15);
+            if (Det != 1 && Det != -1)
+              continue;
+            // The adjugate divided by the determinant
+            for (unsigned Row = 0; Row < 4; ++Row)
+              for (unsigned Col = 0; Col < 4; ++Col)
+                Base.Inverse[Row][Col] =
+                    ((Row + Col) % 2 ? -Det : Det) *
+                    getMinor(M, 15 & ~(1u << Col), 15 & ~(1u << Row));
+            Bases.push_back(Base);
+          }
+    return Bases;
+  }();
+  return Bases;
+}
+
+// The operations with linear identities, their pattern and their values on
+// one bit, indexed by 2 * x + y
+struct LinearOp {
+  unsigned Opcode;
+  StepKind Kind;
+  const char *Pattern;
+  int64_t Values[4];
+};
+
+const LinearOp LinearOps[] = {
+    {Instruction::Add, StepAdd, "x + y", {0, 1, 1, 2}},
+    {Instruction::Sub, StepSub, "x - y", {0, -1, 1, 0}},
+    {Instruction::And, StepAnd, "x & y", {0, 0, 0, 1}},
+    {Instruction::Or, StepOr, "x | y", {0, 1, 1, 1}},
+    {Instruction::Xor, StepXor, "x ^ y", {0, 1, 1, 0}},
+};
+
+const LinearOp *getLinearOp(unsigned Opcode) {
+  for (const LinearOp &Op : LinearOps)
+    if (Op.Opcode == Opcode)
+      return &Op;
+  return nullptr;
+}
+
+// Terms beyond the basis, with random coefficients
+const unsigned MaxExtraTerms = 3;
+// The random coefficients stay below 2^8, so that they are not 0 in i8
+const int64_t MaxCoefficient = 255;
+const unsigned MaxAttempts = 8;
+
+// Append Coef * E to the code and text of R, as the first term or added to
+// the previous ones
+void appendTerm(Rule &R, std::string &Expr, const TableExpr &E, int64_t Coef,
+                bool First) {
+  bool Leaf = E.Code.size() == 1 ||
+              (E.Code.size() == 2 && E.Code[1].Kind == StepNot);
+  bool IsConst = E.Code.size() == 1 && E.Code[0].Kind == StepConst;
+  // The terms after the first one are subtracted rather than multiplied by
+  // a negative coefficient
+  bool Subtract = !First && Coef < 0;
+  uint64_t Magnitude = Subtract ? -(uint64_t)Coef : Coef;
+
+  if (!First)
+    Expr += Subtract ? " - " : " + ";
+  R.Code.insert(R.Code.end(), E.Code.begin(), E.Code.end());
+  std::string Text = Leaf ? E.Text : "(" + std::string(E.Text) + ")";
+  if (IsConst)
+    Expr += std::to_string((int64_t)Magnitude);
+  else if (First && Coef == -1)
+    Expr += "-" + Text;
+  else if (Magnitude == 1)
+    Expr += Text;
+  else
+    Expr += std::to_string((int64_t)Magnitude) + " * " + Text;
+
+  if (First && Coef == -1)
+    R.Code.push_back({StepNeg, 0});
+  else if (Magnitude != 1) {
+    R.Code.push_back({StepConst, (int64_t)Magnitude});
+    R.Code.push_back({StepMul, 0});
+  }
+  if (!First)
+    R.Code.push_back({Subtract ? StepSub : StepAdd, 0});
+}
+
+} // namespace
+
+bool hasLinearRules(const Instruction *I) {
+  if (!getLinearOp(I->getOpcode()))
+    return false;
+  Type *Ty = I->getOperand(0)->getType();
+  return Ty->isIntOrIntVectorTy() && Ty->getScalarSizeInBits() > 1;
+}
+
+bool makeLinearRule(unsigned Opcode, unsigned MaxCost, std::mt19937 &Rng,
+                    Rule &R, std::string &Expr) {
+  const LinearOp *Op = getLinearOp(Opcode);
+  if (!Op)
+    return false;
+  const std::vector<Basis> &Bases = getBases();
+  std::uniform_int_distribution<int64_t> RandomCoef(-MaxCoefficient,
+                                                    MaxCoefficient - 1);
+
+  for (unsigned Attempt = 0; Attempt < MaxAttempts; ++Attempt) {
+    const Basis &Base = Bases[Rng() % Bases.size()];
+    // The tables outside the basis, the extra terms are taken among them
+    SmallVector<unsigned, TableCount> Others;
+    for (unsigned T = 1; T < TableCount; ++T)
+      if (!is_contained(Base.Tables, T))
+        Others.push_back(T);
+    std::shuffle(Others.begin(), Others.end(), Rng);
+
+    // Fewer extra terms until the expression fits MaxCost
+    for (unsigned Extra = 1 + Rng() % MaxExtraTerms; Extra > 0; --Extra) {
+      // Terms as (table, coefficient)
+      SmallVector<std::pair<unsigned, int64_t>, 8> Terms;
+      int64_t Rest[4];
+      std::copy(Op->Values, Op->Values + 4, Rest);
+      for (unsigned K = 0; K < Extra; ++K) {
+        int64_t Coef = RandomCoef(Rng);
+        // Nonzero
+        if (Coef >= 0)
+          ++Coef;
+        Terms.push_back({Others[K], Coef});
+        for (unsigned Row = 0; Row < 4; ++Row)
+          Rest[Row] -= Coef * (Others[K] >> Row & 1);
+      }
+      // The basis makes up the rest
+      for (unsigned K = 0; K < 4; ++K) {
+        int64_t Coef = 0;
+        for (unsigned Row = 0; Row < 4; ++Row)
+          Coef += Base.Inverse[K][Row] * Rest[Row];
+        if (Coef)
+          Terms.push_back({Base.Tables[K], Coef});
+      }
+      std::shuffle(Terms.begin(), Terms.end(), Rng);
+
+      R = Rule{Op->Pattern, Op->Kind, 0, "Linear", nullptr, 1, 0, 0, 1,
+               WidthAll & ~WidthI1, {}};
+      Expr.clear();
+      for (unsigned K = 0; K < Terms.size(); ++K) {
+        const std::vector<TableExpr> &Exprs = getTableExprs(Terms[K].first);
+        int64_t Coef = Terms[K].first == MinusOne ? -Terms[K].second
+                                                  : Terms[K].second;
+        appendTerm(R, Expr, Exprs[Rng() % Exprs.size()], Coef, K == 0);
+      }
+      R.Expr = Expr.c_str();
+      measureRule(R);
+      if (!MaxCost || R.Cost <= MaxCost)
+        return true;
+    }
+  }
+  return false;
+}
+
+} // namespace mba
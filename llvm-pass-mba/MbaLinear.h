@@ -0,0 +1,35 @@
+// Generator of linear MBA identities
+//
+// A linear combination of bitwise expressions of x and y is the same
+// function at every width as soon as it is on one bit: sum(a_i * e_i) =
+// x + y holds if it holds for the four values of (x, y) in {0, 1}^2, which
+// is a system of four linear equations on the a_i. The generator picks a
+// few bitwise expressions at random with random coefficients, and solves
+// for the coefficients of four others, whose truth tables form a basis with
+// determinant +-1. The bases and their inverses are computed once, so a
+// fresh identity only takes a 4x4 matrix product.
+#ifndef OBF_MBA_LINEAR_H
+#define OBF_MBA_LINEAR_H
+
+#include <random>
+#include <string>
+
+#include "llvm/IR/Instruction.h"
+
+#include "MbaRules.h"
+
+namespace mba {
+
+// Whether linear identities exist for I: add, sub, and, or and xor of
+// integers of at least 2 bits
+bool hasLinearRules(const llvm::Instruction *I);
+
+// Generate a linear identity for the operation Opcode into R, costing at
+// most MaxCost (0 = no limit). Expr receives its text, R.Expr points into
+// it. Returns false when no identity fits the cost
+bool makeLinearRule(unsigned Opcode, unsigned MaxCost, std::mt19937 &Rng,
+                    Rule &R, std::string &Expr);
+
+} // namespace mba
+
+#endif
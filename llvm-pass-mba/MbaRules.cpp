@@ -0,0 +1,695 @@
+#include "MbaRules.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/ErrorHandling.h"
+
+using namespace llvm;
+
+namespace mba {
+
+namespace {
+
+struct RuleDecl {
+  const char *Pattern;
+  const char *Name;
+  const char *Expr;
+  unsigned Weight;
+  // Widths the rule is used for, every width but i1 when left out
+  unsigned Widths = 0;
+};
+
+// 64-bit masks and the sign bit of i64 take a movabs on x86-64, the rules
+// built on such constants are kept to the narrower widths
+const unsigned Narrow = WidthI8 | WidthI16 | WidthI32 | WidthOther;
+const unsigned PowerOf2 = WidthI8 | WidthI16 | WidthI32 | WidthI64;
+
+// The identities. A new one only needs a line here: the expression must be
+// equal to the pattern for every x, y and z, modulo 2^n.
+//
+// Besides the operators of C, the expressions use
+// - ">>" for the logical shift right, "<u", "<=s"... for the unsigned and
+//   signed comparisons
+// - fshl(x, y, z) and fshr(x, y, z) for the funnel shift intrinsics, which
+//   are also the rotates when x and y are the same value
+// - BITS for the bit width of the operands, SMIN for the sign bit alone.
+//   Constants are truncated to the width of the operands
+//
+// On i1, + and - are ^ and * is &: the multiplications by 2 of the
+// arithmetic rules vanish, so i1 has its own rules in boolean logic
+const RuleDecl RuleTable[] = {
+    {"x + y", "SubAdd", "2 * (x | y) - (x ^ y)", 1},
+    {"x + y", "SubAdd2", "(x ^ ~y) + 2 * (x | y) + 1", 1},
+    {"x + y", "SubAdd3", "(x ^ y) + 2 * y - 2 * (~x & y)", 1},
+
+    {"x - y", "SubSub", "2 * (x & ~y) - (x ^ y)", 1},
+    // From VMProtect
+    {"x - y", "SubSub2", "-(-x + y) & -(-x + y)", 1},
+    // From Tigress
+    {"x - y", "SubSub3", "(x & ~y) - (~x & y)", 1},
+
+    {"x ^ y", "SubXor", "(x | y) - (x & y)", 1},
+    {"x ^ y", "SubXor2", "(x | y) - y + (~x & y)", 1},
+    {"x ^ y", "SubXor3", "(x | y) - (~x | y) + ~x", 1},
+
+    {"x & y", "SubAnd", "(~x | y) - ~x", 1},
+    {"x & y", "SubAnd2", "(x | y) - (~x & y) - (x & ~y)", 1},
+    {"x & y", "SubAnd3", "-(x ^ y) + y + (x & ~y)", 1},
+
+    {"x | y", "SubOr", "(x & ~y) + y", 1},
+    {"x | y", "SubOr2", "(x ^ y) + y - (~x & y)", 1},
+    {"x | y", "SubOr3", "(x ^ y) + (~x | y) - ~x", 1},
+
+    {"x * y", "SubMul", "(x & y) * (x | y) + (x & ~y) * (~x & y)", 1},
+    {"x * y", "SubMul2", "(x | y) * (x & y) + ~(x | ~y) * (x & ~y)", 1},
+    {"x * y", "SubMul3", "(x * (y >> 1) << 1) + (x & -(y & 1))", 1},
+
+    // A shift left is a multiplication, it distributes over + and -. The
+    // masks can be constants, or the shift amount itself
+    {"x << y", "SubShl",
+     "((x & 0x5555555555555555) << y) + ((x & ~0x5555555555555555) << y)", 1,
+     Narrow},
+    {"x << y", "SubShl2",
+     "((x ^ 0x3c3c3c3c3c3c3c3c) << y) ^ (0x3c3c3c3c3c3c3c3c << y)", 1, Narrow},
+    {"x << y", "SubShl3",
+     "((x | 0x0f0f0f0f0f0f0f0f) << y) - ((0x0f0f0f0f0f0f0f0f & ~x) << y)", 1,
+     Narrow},
+    {"x << y", "SubShl4", "((x & y) << y) + ((x & ~y) << y)", 1},
+    {"x << y", "SubShl5", "((x ^ y) << y) ^ (y << y)", 1},
+
+    // A logical shift right only distributes over the bitwise operators,
+    // and over + of disjoint values
+    {"x >> y", "SubLShr",
+     "((x & 0x5555555555555555) >> y) | ((x & ~0x5555555555555555) >> y)", 1,
+     Narrow},
+    {"x >> y", "SubLShr2",
+     "((x ^ 0x3c3c3c3c3c3c3c3c) >> y) ^ (0x3c3c3c3c3c3c3c3c >> y)", 1, Narrow},
+    {"x >> y", "SubLShr3",
+     "((x & 0x0f0f0f0f0f0f0f0f) >> y) + ((x & ~0x0f0f0f0f0f0f0f0f) >> y)", 1,
+     Narrow},
+    {"x >> y", "SubLShr4", "((x & y) >> y) | ((x & ~y) >> y)", 1},
+    {"x >> y", "SubLShr5", "((x ^ y) >> y) ^ (y >> y)", 1},
+
+    // The expansions into shifts mask the shift amount with BITS - 1, they
+    // need a power of two width. Funnel shifts of the other widths are not
+    // replaced at all, the x86 backend of LLVM 14 reduces their amount
+    // modulo the width without clearing its upper bits
+    {"fshl(x, y, z)", "SubFshl",
+     "(x << (z & (BITS - 1))) | ((y >> 1) >> (~z & (BITS - 1)))", 1,
+     PowerOf2},
+    {"fshl(x, y, z)", "SubFshl2",
+     "fshl(x ^ 0x3c3c3c3c3c3c3c3c, y ^ 0x3c3c3c3c3c3c3c3c, z) ^ "
+     "fshl(0x3c3c3c3c3c3c3c3c, 0x3c3c3c3c3c3c3c3c, z)",
+     1, Narrow & PowerOf2},
+    {"fshl(x, y, z)", "SubFshl3", "fshl(x ^ z, y ^ z, z) ^ fshl(z, z, z)", 1,
+     PowerOf2},
+    {"fshr(x, y, z)", "SubFshr",
+     "((x << 1) << (~z & (BITS - 1))) | (y >> (z & (BITS - 1)))", 1,
+     PowerOf2},
+    {"fshr(x, y, z)", "SubFshr2",
+     "fshr(x & 0x5555555555555555, y & 0x5555555555555555, z) | "
+     "fshr(x & ~0x5555555555555555, y & ~0x5555555555555555, z)",
+     1, Narrow & PowerOf2},
+    {"fshr(x, y, z)", "SubFshr3",
+     "fshr(x & z, y & z, z) | fshr(x & ~z, y & ~z, z)", 1, PowerOf2},
+
+    // ~ reverses the order, in signed and in unsigned, and flipping the
+    // sign bit turns one order into the other
+    {"x == y", "SubEq", "(x ^ y) == 0", 1},
+    {"x == y", "SubEq2", "(x - y) == 0", 1},
+    {"x != y", "SubNe", "(x ^ y) != 0", 1},
+    {"x != y", "SubNe2", "(x - y) != 0", 1},
+    {"x <u y", "SubUlt", "~y <u ~x", 1},
+    {"x <u y", "SubUlt2", "(x ^ SMIN) <s (y ^ SMIN)", 1, Narrow},
+    {"x <=u y", "SubUle", "~y <=u ~x", 1},
+    {"x <=u y", "SubUle2", "(x ^ SMIN) <=s (y ^ SMIN)", 1, Narrow},
+    {"x >u y", "SubUgt", "~y >u ~x", 1},
+    {"x >u y", "SubUgt2", "(x ^ SMIN) >s (y ^ SMIN)", 1, Narrow},
+    {"x >=u y", "SubUge", "~y >=u ~x", 1},
+    {"x >=u y", "SubUge2", "(x ^ SMIN) >=s (y ^ SMIN)", 1, Narrow},
+    {"x <s y", "SubSlt", "~y <s ~x", 1},
+    {"x <s y", "SubSlt2", "(x ^ SMIN) <u (y ^ SMIN)", 1, Narrow},
+    {"x <=s y", "SubSle", "~y <=s ~x", 1},
+    {"x <=s y", "SubSle2", "(x ^ SMIN) <=u (y ^ SMIN)", 1, Narrow},
+    {"x >s y", "SubSgt", "~y >s ~x", 1},
+    {"x >s y", "SubSgt2", "(x ^ SMIN) >u (y ^ SMIN)", 1, Narrow},
+    {"x >=s y", "SubSge", "~y >=s ~x", 1},
+    {"x >=s y", "SubSge2", "(x ^ SMIN) >=u (y ^ SMIN)", 1, Narrow},
+
+    {"x + y", "SubAddI1", "(x | y) & ~(x & y)", 1, WidthI1},
+    {"x + y", "SubAddI1b", "(x & ~y) | (~x & y)", 1, WidthI1},
+    {"x - y", "SubSubI1", "(x | y) & (~x | ~y)", 1, WidthI1},
+    {"x - y", "SubSubI1b", "(x & ~y) | (~x & y)", 1, WidthI1},
+    {"x ^ y", "SubXorI1", "(x | y) & ~(x & y)", 1, WidthI1},
+    {"x ^ y", "SubXorI1b", "(x | y) ^ (x & y)", 1, WidthI1},
+    {"x & y", "SubAndI1", "~(~x | ~y)", 1, WidthI1},
+    {"x & y", "SubAndI1b", "x & ~(x ^ y)", 1, WidthI1},
+    {"x | y", "SubOrI1", "~(~x & ~y)", 1, WidthI1},
+    {"x | y", "SubOrI1b", "x ^ (y & ~x)", 1, WidthI1},
+    {"x * y", "SubMulI1", "~(~x | ~y)", 1, WidthI1},
+    // 1 is -1 in signed i1
+    {"x == y", "SubEqI1", "~(x ^ y)", 1, WidthI1},
+    {"x != y", "SubNeI1", "x ^ y", 1, WidthI1},
+    {"x <u y", "SubUltI1", "~x & y", 1, WidthI1},
+    {"x <=u y", "SubUleI1", "~x | y", 1, WidthI1},
+    {"x >u y", "SubUgtI1", "x & ~y", 1, WidthI1},
+    {"x >=u y", "SubUgeI1", "x | ~y", 1, WidthI1},
+    {"x <s y", "SubSltI1", "x & ~y", 1, WidthI1},
+    {"x <=s y", "SubSleI1", "x | ~y", 1, WidthI1},
+    {"x >s y", "SubSgtI1", "~x & y", 1, WidthI1},
+    {"x >=s y", "SubSgeI1", "~x | y", 1, WidthI1},
+};
+
+unsigned getArity(StepKind Kind) {
+  switch (Kind) {
+  case StepX:
+  case StepY:
+  case StepZ:
+  case StepConst:
+  case StepBits:
+  case StepSignMask:
+    return 0;
+  case StepNot:
+  case StepNeg:
+    return 1;
+  case StepFshl:
+  case StepFshr:
+    return 3;
+  default:
+    return 2;
+  }
+}
+
+unsigned getStepCost(StepKind Kind) { return Kind == StepMul ? 3 : 1; }
+
+// Recursive descent over the expression of a rule, with the precedence of
+// C, appending the steps in postfix order
+class Parser {
+  const char *Name;
+  const char *Cur;
+  std::vector<Step> &Code;
+
+  void fail(const char *Msg) {
+    report_fatal_error(Twine("mba: rule ") + Name + ": " + Msg);
+  }
+
+  char peek() {
+    while (isspace((unsigned char)*Cur))
+      ++Cur;
+    return *Cur;
+  }
+
+  bool consume(const char *Token) {
+    peek();
+    size_t Len = strlen(Token);
+    if (strncmp(Cur, Token, Len))
+      return false;
+    Cur += Len;
+    return true;
+  }
+
+  void expect(const char *Token) {
+    if (!consume(Token))
+      fail((Twine("expected '") + Token + "'").str().c_str());
+  }
+
+  void emit(StepKind Kind, int64_t Imm = 0) { Code.push_back({Kind, Imm}); }
+
+  void parsePrimary() {
+    char C = peek();
+    if (consume("(")) {
+      parseOr();
+      expect(")");
+    } else if (consume("fshl(") || consume("fshr(")) {
+      StepKind Kind = Cur[-2] == 'l' ? StepFshl : StepFshr;
+      parseOr();
+      expect(",");
+      parseOr();
+      expect(",");
+      parseOr();
+      expect(")");
+      emit(Kind);
+    } else if (consume("BITS")) {
+      emit(StepBits);
+    } else if (consume("SMIN")) {
+      emit(StepSignMask);
+    } else if (C == 'x' || C == 'y' || C == 'z') {
+      ++Cur;
+      emit(C == 'x' ? StepX : C == 'y' ? StepY : StepZ);
+    } else if (isdigit((unsigned char)C)) {
+      char *End;
+      int64_t Imm = strtoll(Cur, &End, 0);
+      Cur = End;
+      emit(StepConst, Imm);
+    } else {
+      fail("expected an operand");
+    }
+  }
+
+  void parseUnary() {
+    char C = peek();
+    if (C == '~' || C == '-') {
+      ++Cur;
+      parseUnary();
+      emit(C == '~' ? StepNot : StepNeg);
+      return;
+    }
+    parsePrimary();
+  }
+
+  void parseMul() {
+    parseUnary();
+    while (peek() == '*') {
+      ++Cur;
+      parseUnary();
+      emit(StepMul);
+    }
+  }
+
+  void parseAdd() {
+    parseMul();
+    for (char C = peek(); C == '+' || C == '-'; C = peek()) {
+      ++Cur;
+      parseMul();
+      emit(C == '+' ? StepAdd : StepSub);
+    }
+  }
+
+  void parseShift() {
+    parseAdd();
+    for (;;) {
+      if (consume("<<")) {
+        parseAdd();
+        emit(StepShl);
+      } else if (consume(">>")) {
+        parseAdd();
+        emit(StepLShr);
+      } else {
+        return;
+      }
+    }
+  }
+
+  // "<" and ">" take a suffix: u for unsigned, s for signed
+  void parseRelational() {
+    parseShift();
+    char C = peek();
+    if ((C != '<' && C != '>') || Cur[1] == C)
+      return;
+    ++Cur;
+    bool OrEqual = *Cur == '=';
+    if (OrEqual)
+      ++Cur;
+    bool Signed = *Cur == 's';
+    if (*Cur != 'u' && *Cur != 's')
+      fail("expected 'u' or 's' after the comparison");
+    ++Cur;
+    CmpInst::Predicate Pred;
+    if (C == '<')
+      Pred = Signed ? (OrEqual ? CmpInst::ICMP_SLE : CmpInst::ICMP_SLT)
+                    : (OrEqual ? CmpInst::ICMP_ULE : CmpInst::ICMP_ULT);
+    else
+      Pred = Signed ? (OrEqual ? CmpInst::ICMP_SGE : CmpInst::ICMP_SGT)
+                    : (OrEqual ? CmpInst::ICMP_UGE : CmpInst::ICMP_UGT);
+    parseShift();
+    emit(StepICmp, Pred);
+  }
+
+  void parseEquality() {
+    parseRelational();
+    if (consume("==")) {
+      parseRelational();
+      emit(StepICmp, CmpInst::ICMP_EQ);
+    } else if (consume("!=")) {
+      parseRelational();
+      emit(StepICmp, CmpInst::ICMP_NE);
+    }
+  }
+
+  void parseAnd() {
+    parseEquality();
+    while (peek() == '&') {
+      ++Cur;
+      parseEquality();
+      emit(StepAnd);
+    }
+  }
+
+  void parseXor() {
+    parseAnd();
+    while (peek() == '^') {
+      ++Cur;
+      parseAnd();
+      emit(StepXor);
+    }
+  }
+
+  void parseOr() {
+    parseXor();
+    while (peek() == '|') {
+      ++Cur;
+      parseXor();
+      emit(StepOr);
+    }
+  }
+
+public:
+  Parser(const char *Name, const char *Text, std::vector<Step> &Code)
+      : Name(Name), Cur(Text), Code(Code) {}
+
+  void parse() {
+    parseOr();
+    if (peek() != '\0')
+      fail("unexpected character");
+  }
+};
+
+std::vector<Rule> compileRules() {
+  std::vector<Rule> Rules;
+  for (const RuleDecl &Decl : RuleTable) {
+    Rule R{Decl.Pattern, StepX, 0, Decl.Name, Decl.Expr, Decl.Weight,
+           0,            0,     1, Decl.Widths, {}};
+    if (!R.Widths)
+      R.Widths = WidthAll & ~WidthI1;
+
+    // The pattern must be a single step on x, y and z, in that order
+    std::vector<Step> Pattern;
+    Parser(Decl.Name, Decl.Pattern, Pattern).parse();
+    unsigned Arity = getArity(Pattern.back().Kind);
+    if (!Arity || Pattern.size() != Arity + 1)
+      report_fatal_error(Twine("mba: rule ") + Decl.Name +
+                         ": the pattern is not one operation");
+    for (unsigned I = 0; I < Arity; ++I)
+      if (Pattern[I].Kind != StepX + I)
+        report_fatal_error(Twine("mba: rule ") + Decl.Name +
+                           ": the pattern does not use x, y, z in order");
+    R.Kind = Pattern.back().Kind;
+    R.Imm = Pattern.back().Imm;
+
+    Parser(Decl.Name, Decl.Expr, R.Code).parse();
+    measureRule(R);
+    Rules.push_back(std::move(R));
+  }
+  return Rules;
+}
+
+// The step computing I, as a rule pattern would name it
+bool getStep(const Instruction *I, StepKind &Kind, int64_t &Imm) {
+  Imm = 0;
+  if (auto *Cmp = dyn_cast<ICmpInst>(I)) {
+    Kind = StepICmp;
+    Imm = Cmp->getPredicate();
+    return true;
+  }
+  if (auto *Intr = dyn_cast<IntrinsicInst>(I)) {
+    switch (Intr->getIntrinsicID()) {
+    case Intrinsic::fshl:
+      Kind = StepFshl;
+      return true;
+    case Intrinsic::fshr:
+      Kind = StepFshr;
+      return true;
+    default:
+      return false;
+    }
+  }
+  switch (I->getOpcode()) {
+  case Instruction::Add:
+    Kind = StepAdd;
+    return true;
+  case Instruction::Sub:
+    Kind = StepSub;
+    return true;
+  case Instruction::Mul:
+    Kind = StepMul;
+    return true;
+  case Instruction::Shl:
+    Kind = StepShl;
+    return true;
+  case Instruction::LShr:
+    Kind = StepLShr;
+    return true;
+  case Instruction::And:
+    Kind = StepAnd;
+    return true;
+  case Instruction::Or:
+    Kind = StepOr;
+    return true;
+  case Instruction::Xor:
+    Kind = StepXor;
+    return true;
+  default:
+    return false;
+  }
+}
+
+ExprKey makeKey(StepKind Kind, int64_t Imm, Value *LHS, Value *RHS) {
+  switch (Kind) {
+  case StepAdd:
+  case StepMul:
+  case StepAnd:
+  case StepOr:
+  case StepXor:
+    if (std::less<Value *>()(RHS, LHS))
+      std::swap(LHS, RHS);
+    break;
+  default:
+    break;
+  }
+  return {Kind | (unsigned)Imm << 8, {LHS, RHS}};
+}
+
+// The key I was emitted with, as built by CreateNot, CreateNeg and the
+// other steps of at most two operands
+bool keyOf(Instruction *I, ExprKey &Key) {
+  StepKind Kind;
+  int64_t Imm;
+  if (!getStep(I, Kind, Imm) || getArity(Kind) != 2)
+    return false;
+  Value *LHS = I->getOperand(0);
+  Value *RHS = I->getOperand(1);
+  if (Kind == StepSub)
+    if (auto *C = dyn_cast<Constant>(LHS))
+      if (C->isNullValue()) {
+        Key = makeKey(StepNeg, 0, RHS, nullptr);
+        return true;
+      }
+  if (Kind == StepXor)
+    if (auto *C = dyn_cast<Constant>(RHS))
+      if (C->isAllOnesValue()) {
+        Key = makeKey(StepNot, 0, LHS, nullptr);
+        return true;
+      }
+  Key = makeKey(Kind, Imm, LHS, RHS);
+  return true;
+}
+
+void forgetKeyOf(ExprMemo &Memo, Instruction *I) {
+  ExprKey Key;
+  if (!keyOf(I, Key))
+    return;
+  auto It = Memo.find(Key);
+  if (It != Memo.end() && It->second == I)
+    Memo.erase(It);
+}
+
+// Pop the operands of a step and emit it, leaving the first operand on the
+// stack for the caller to replace
+Value *emitStep(const Step &S, IRBuilder<> &Builder,
+                SmallVectorImpl<Value *> &Stack) {
+  switch (S.Kind) {
+  case StepNot:
+    return Builder.CreateNot(Stack.back());
+  case StepNeg:
+    return Builder.CreateNeg(Stack.back());
+  case StepFshl:
+  case StepFshr: {
+    Value *C = Stack.pop_back_val();
+    Value *B = Stack.pop_back_val();
+    Value *A = Stack.back();
+    return Builder.CreateIntrinsic(
+        S.Kind == StepFshl ? Intrinsic::fshl : Intrinsic::fshr,
+        {A->getType()}, {A, B, C});
+  }
+  default:
+    break;
+  }
+
+  Value *RHS = Stack.pop_back_val();
+  Value *LHS = Stack.back();
+  switch (S.Kind) {
+  case StepAdd:
+    return Builder.CreateAdd(LHS, RHS);
+  case StepSub:
+    return Builder.CreateSub(LHS, RHS);
+  case StepMul:
+    return Builder.CreateMul(LHS, RHS);
+  case StepShl:
+    return Builder.CreateShl(LHS, RHS);
+  case StepLShr:
+    return Builder.CreateLShr(LHS, RHS);
+  case StepAnd:
+    return Builder.CreateAnd(LHS, RHS);
+  case StepOr:
+    return Builder.CreateOr(LHS, RHS);
+  case StepXor:
+    return Builder.CreateXor(LHS, RHS);
+  case StepICmp:
+    return Builder.CreateICmp((CmpInst::Predicate)S.Imm, LHS, RHS);
+  default:
+    llvm_unreachable("not an operation");
+  }
+}
+
+} // namespace
+
+void parseExpr(const char *Name, const char *Expr, std::vector<Step> &Code) {
+  Parser(Name, Expr, Code).parse();
+}
+
+void measureRule(Rule &R) {
+  R.Cost = 0;
+  R.Size = 0;
+  R.MinBits = 1;
+  // The steps on constants alone are folded by the IRBuilder, they cost
+  // nothing
+  SmallVector<bool, 8> IsConst;
+  for (size_t I = 0; I < R.Code.size(); ++I) {
+    const Step &S = R.Code[I];
+    unsigned Arity = getArity(S.Kind);
+    // A shift by n is poison below n + 1 bits
+    if ((S.Kind == StepShl || S.Kind == StepLShr) &&
+        R.Code[I - 1].Kind == StepConst)
+      R.MinBits = std::max<unsigned>(R.MinBits, R.Code[I - 1].Imm + 1);
+    bool AllConst = true;
+    for (unsigned I = 0; I < Arity; ++I)
+      AllConst &= IsConst.pop_back_val();
+    if (!Arity)
+      AllConst = S.Kind != StepX && S.Kind != StepY && S.Kind != StepZ;
+    else if (!AllConst) {
+      ++R.Size;
+      R.Cost += getStepCost(S.Kind);
+    }
+    IsConst.push_back(AllConst);
+  }
+}
+
+const std::vector<Rule> &getRules() {
+  static const std::vector<Rule> Rules = compileRules();
+  return Rules;
+}
+
+unsigned getWidthClass(unsigned Bits) {
+  switch (Bits) {
+  case 1:
+    return WidthI1;
+  case 8:
+    return WidthI8;
+  case 16:
+    return WidthI16;
+  case 32:
+    return WidthI32;
+  case 64:
+    return WidthI64;
+  default:
+    return WidthOther;
+  }
+}
+
+const std::vector<const Rule *> &getRules(const Instruction *I) {
+  // By operation and width class, so picking a rule does not look at the
+  // rules of the other widths
+  typedef DenseMap<std::pair<unsigned, unsigned>, std::vector<const Rule *>>
+      RuleMap;
+  static const RuleMap ByStep = [] {
+    RuleMap ByStep;
+    for (const Rule &R : getRules())
+      for (unsigned Class = 1; Class <= WidthOther; Class <<= 1)
+        if (R.Widths & Class)
+          ByStep[{R.Kind | (unsigned)R.Imm << 8, Class}].push_back(&R);
+    return ByStep;
+  }();
+  static const std::vector<const Rule *> None;
+  StepKind Kind;
+  int64_t Imm;
+  if (!getStep(I, Kind, Imm))
+    return None;
+  unsigned Bits = I->getOperand(0)->getType()->getScalarSizeInBits();
+  auto It = ByStep.find({Kind | (unsigned)Imm << 8, getWidthClass(Bits)});
+  return It != ByStep.end() ? It->second : None;
+}
+
+SmallVector<Value *, 3> getOperands(const Instruction *I) {
+  if (auto *Call = dyn_cast<CallInst>(I))
+    return SmallVector<Value *, 3>(Call->arg_begin(), Call->arg_end());
+  return {I->getOperand(0), I->getOperand(1)};
+}
+
+void forgetExpr(ExprMemo &Memo, Instruction *I) {
+  forgetKeyOf(Memo, I);
+  for (User *U : I->users())
+    if (auto *UI = dyn_cast<Instruction>(U))
+      forgetKeyOf(Memo, UI);
+}
+
+Value *emitRule(const Rule &R, IRBuilder<> &Builder, ArrayRef<Value *> Ops,
+                SmallVectorImpl<Instruction *> *Emitted, ExprMemo *Memo) {
+  Type *Ty = Ops[0]->getType();
+  SmallVector<Value *, 8> Stack;
+  for (const Step &S : R.Code) {
+    // Constants are splatted when Ty is a vector
+    switch (S.Kind) {
+    case StepX:
+    case StepY:
+    case StepZ:
+      Stack.push_back(Ops[S.Kind - StepX]);
+      continue;
+    case StepConst:
+      Stack.push_back(ConstantInt::get(Ty, S.Imm, true));
+      continue;
+    case StepBits:
+      Stack.push_back(ConstantInt::get(Ty, Ty->getScalarSizeInBits()));
+      continue;
+    case StepSignMask:
+      Stack.push_back(ConstantInt::get(
+          Ty, APInt::getSignMask(Ty->getScalarSizeInBits())));
+      continue;
+    default:
+      break;
+    }
+
+    // Reuse the value if the block already computes it
+    unsigned Arity = getArity(S.Kind);
+    ExprKey Key;
+    bool Memoize = Memo && Arity <= 2;
+    if (Memoize) {
+      Value *LHS = Stack[Stack.size() - Arity];
+      Key = makeKey(S.Kind, S.Imm, LHS, Arity == 2 ? Stack.back() : nullptr);
+      auto It = Memo->find(Key);
+      if (It != Memo->end()) {
+        Stack.resize(Stack.size() - Arity + 1);
+        Stack.back() = It->second;
+        continue;
+      }
+    }
+
+    Value *Result = emitStep(S, Builder, Stack);
+    Stack.back() = Result;
+    if (!isa<Instruction>(Result))
+      continue;
+    if (Emitted)
+      Emitted->push_back(cast<Instruction>(Result));
+    if (Memoize)
+      (*Memo)[Key] = Result;
+  }
+  assert(Stack.size() == 1 && "unbalanced rule");
+  return Stack.back();
+}
+
+} // namespace mba
@@ -0,0 +1,127 @@
+// Table of the MBA identities used by MbaPass
+//
+// Each identity is declared as data: the operation it replaces, as a
+// pattern over the operands x, y and z, and the expression replacing it,
+// both in C syntax and precedence. The table is compiled once per process
+// into postfix programs, which are replayed with an IRBuilder at every
+// substitution.
+#ifndef OBF_MBA_RULES_H
+#define OBF_MBA_RULES_H
+
+#include <cstdint>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/IRBuilder.h"
+
+namespace mba {
+
+// One step of a compiled expression. Leaves push a value, the other steps
+// pop their operands and push the result
+enum StepKind : uint8_t {
+  StepX,
+  StepY,
+  StepZ,
+  StepConst,
+  // The bit width of the operands
+  StepBits,
+  // The sign bit alone
+  StepSignMask,
+  StepNot,
+  StepNeg,
+  StepAdd,
+  StepSub,
+  StepMul,
+  StepShl,
+  StepLShr,
+  StepAnd,
+  StepOr,
+  StepXor,
+  // Imm holds the predicate
+  StepICmp,
+  StepFshl,
+  StepFshr
+};
+
+struct Step {
+  StepKind Kind;
+  int64_t Imm;
+};
+
+// Classes of integer widths a rule is used for
+enum WidthClass : unsigned {
+  WidthI1 = 1,
+  WidthI8 = 2,
+  WidthI16 = 4,
+  WidthI32 = 8,
+  WidthI64 = 16,
+  WidthOther = 32,
+  WidthAll = 63
+};
+
+// The class of a width in bits
+unsigned getWidthClass(unsigned Bits);
+
+struct Rule {
+  // The replaced operation, and the kind and immediate of the single step
+  // of its pattern
+  const char *Pattern;
+  StepKind Kind;
+  int64_t Imm;
+  const char *Name;
+  const char *Expr;
+  // Relative weight when picking among the rules of an operation
+  unsigned Weight;
+  // Estimated cost of the emitted instructions, a multiplication counts
+  // for 3
+  unsigned Cost;
+  // Number of instructions the rule emits
+  unsigned Size;
+  // Smallest width the rule holds for, above the constant shift amounts
+  unsigned MinBits;
+  // Width classes the rule is used for
+  unsigned Widths;
+  std::vector<Step> Code;
+};
+
+// Values already emitted by the rules, by step and operands. The operands
+// of commutative steps are sorted, unary steps have no second operand
+typedef std::pair<unsigned, std::pair<llvm::Value *, llvm::Value *>> ExprKey;
+typedef llvm::DenseMap<ExprKey, llvm::Value *> ExprMemo;
+
+// All the rules, compiled on first use
+const std::vector<Rule> &getRules();
+
+// Compile Expr, in the syntax of the rule table, into Code. Name is the
+// rule reported in the errors
+void parseExpr(const char *Name, const char *Expr, std::vector<Step> &Code);
+
+// Compute the Cost, Size and MinBits of R from its Code
+void measureRule(Rule &R);
+
+// The rules replacing I at its width, empty if there are none
+const std::vector<const Rule *> &getRules(const llvm::Instruction *I);
+
+// The operands of I, in the order of x, y and z
+llvm::SmallVector<llvm::Value *, 3> getOperands(const llvm::Instruction *I);
+
+// Emit R at the insertion point of Builder on the operands Ops. The
+// created instructions are appended to Emitted when it is given. With a
+// Memo, the steps found in it are reused instead of emitted again, and the
+// emitted ones are added to it: every value in Memo must come before the
+// insertion point
+llvm::Value *
+emitRule(const Rule &R, llvm::IRBuilder<> &Builder,
+         llvm::ArrayRef<llvm::Value *> Ops,
+         llvm::SmallVectorImpl<llvm::Instruction *> *Emitted = nullptr,
+         ExprMemo *Memo = nullptr);
+
+// Remove I, and the entries using I as an operand, from Memo before I is
+// erased
+void forgetExpr(ExprMemo &Memo, llvm::Instruction *I);
+
+} // namespace mba
+
+#endif
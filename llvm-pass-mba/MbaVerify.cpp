@@ -0,0 +1,425 @@
+// Equivalence checker for the rules of MbaRules.cpp, and for identities of
+// the linear MBA generator of MbaLinear.cpp
+//
+// Every rule and its pattern are compiled with the JIT, each in a function
+// of its own, at each width the rule is used for. The two are compared on
+// every input at up to -exhaustive-bits bits (all pairs, all triples of i8
+// for the funnel shifts), and on the edge values and -samples random
+// inputs above. The default of 12 bits takes i8 and i12 exhaustively and
+// samples i16, so a run takes seconds; -exhaustive-bits=16 checks all the
+// pairs of i16 as well, which takes about half an hour of CPU time.
+// Shift amounts are kept below the width, where the shifts are defined.
+//
+// usage: MbaVerify [-exhaustive-bits=12] [-samples=N] [-j=N]
+//                  [-linear=N] [-rule=<name>]
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include "MbaLinear.h"
+#include "MbaRules.h"
+
+using namespace llvm;
+using namespace mba;
+
+static cl::opt<unsigned> ExhaustiveBits(
+    "exhaustive-bits",
+    cl::desc("Check every input of the widths up to this many bits"),
+    cl::init(12));
+
+static cl::opt<unsigned> SampleLog(
+    "samples", cl::desc("Check 2^N random inputs of the wider widths"),
+    cl::value_desc("N"), cl::init(24));
+
+static cl::opt<unsigned> Threads(
+    "j", cl::desc("Number of threads (0 = one per core)"), cl::init(0));
+
+static cl::opt<unsigned> LinearRules(
+    "linear",
+    cl::desc("Number of generated linear identities to check per operation"),
+    cl::init(8));
+
+static cl::opt<std::string> OnlyRule("rule",
+                                     cl::desc("Check only the named rule"),
+                                     cl::init(""));
+
+namespace {
+
+// Values around the boundaries of the arithmetic, truncated to the width
+const uint64_t EdgeValues[] = {0,
+                               1,
+                               2,
+                               3,
+                               ~0ULL,
+                               ~1ULL,
+                               0x8000000000000000ULL,
+                               0x7fffffffffffffffULL,
+                               0x8000000000000001ULL,
+                               0x5555555555555555ULL,
+                               0xaaaaaaaaaaaaaaaaULL,
+                               0x0f0f0f0f0f0f0f0fULL,
+                               0x3c3c3c3c3c3c3c3cULL,
+                               0x00000000ffffffffULL,
+                               0xffffffff00000000ULL,
+                               0x0123456789abcdefULL};
+const unsigned EdgeCount = sizeof(EdgeValues) / sizeof(EdgeValues[0]);
+
+// Checks one rule at one width. Count returns the number of inputs in
+// [Begin, End) where the rule and its pattern differ, Decode the operands
+// of one input
+typedef uint64_t (*CountFn)(uint64_t Begin, uint64_t End);
+typedef void (*DecodeFn)(uint64_t Index, uint64_t *Ops);
+
+struct Job {
+  const Rule *R;
+  unsigned Bits;
+  bool Exhaustive;
+  uint64_t Inputs;
+  std::string Name;
+  CountFn Count = nullptr;
+  DecodeFn Decode = nullptr;
+  std::atomic<uint64_t> Failures{0};
+  std::atomic<uint64_t> FirstFailure{~0ULL};
+};
+
+unsigned getArity(const Rule &R) {
+  return R.Kind == StepFshl || R.Kind == StepFshr ? 3 : 2;
+}
+
+bool isShift(const Rule &R) {
+  return R.Kind == StepShl || R.Kind == StepLShr;
+}
+
+// The widths a rule is checked at, one per class it is used for
+SmallVector<unsigned, 6> getCheckedWidths(const Rule &R) {
+  // Odd widths are represented by i12
+  const unsigned Widths[] = {1, 8, 16, 32, 64, 12};
+  SmallVector<unsigned, 6> Result;
+  for (unsigned Bits : Widths)
+    if ((R.Widths & getWidthClass(Bits)) && Bits >= R.MinBits)
+      Result.push_back(Bits);
+  return Result;
+}
+
+Value *splitMix(IRBuilder<> &B, Value *V) {
+  Type *Ty = V->getType();
+  V = B.CreateAdd(V, ConstantInt::get(Ty, 0x9e3779b97f4a7c15ULL));
+  V = B.CreateMul(B.CreateXor(V, B.CreateLShr(V, 30)),
+                  ConstantInt::get(Ty, 0xbf58476d1ce4e5b9ULL));
+  V = B.CreateMul(B.CreateXor(V, B.CreateLShr(V, 27)),
+                  ConstantInt::get(Ty, 0x94d049bb133111ebULL));
+  return B.CreateXor(V, B.CreateLShr(V, 31));
+}
+
+// The operands of input Index of J, as iN values
+SmallVector<Value *, 3> emitDecode(IRBuilder<> &B, Module &M, const Job &J,
+                                   Value *Index) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I64 = Type::getInt64Ty(Ctx);
+  Type *Ty = Type::getIntNTy(Ctx, J.Bits);
+  unsigned Arity = getArity(*J.R);
+  SmallVector<Value *, 3> Ops;
+
+  if (J.Exhaustive) {
+    // Index is the concatenation of the operands, the shift amount only
+    // takes the values below the width
+    for (unsigned I = 0; I < Arity; ++I)
+      Ops.push_back(
+          B.CreateTrunc(B.CreateLShr(Index, I * J.Bits), Ty, "op"));
+    return Ops;
+  }
+
+  // The first inputs go through the edge values, the others are random
+  ArrayType *TableTy = ArrayType::get(I64, EdgeCount);
+  SmallVector<Constant *, 16> Edges;
+  for (uint64_t V : EdgeValues)
+    Edges.push_back(ConstantInt::get(I64, V));
+  auto *Table = new GlobalVariable(M, TableTy, true,
+                                   GlobalValue::PrivateLinkage,
+                                   ConstantArray::get(TableTy, Edges), "edges");
+  uint64_t EdgeInputs = 1;
+  for (unsigned I = 0; I < Arity; ++I)
+    EdgeInputs *= EdgeCount;
+  Value *IsEdge = B.CreateICmpULT(Index, ConstantInt::get(I64, EdgeInputs));
+  Value *Digits = Index;
+  for (unsigned I = 0; I < Arity; ++I) {
+    Value *Digit = B.CreateURem(Digits, ConstantInt::get(I64, EdgeCount));
+    Digits = B.CreateUDiv(Digits, ConstantInt::get(I64, EdgeCount));
+    Value *Edge = B.CreateLoad(
+        I64, B.CreateInBoundsGEP(TableTy, Table,
+                                 {ConstantInt::get(I64, 0), Digit}));
+    Value *Random = splitMix(
+        B, B.CreateAdd(Index, ConstantInt::get(I64, I * 0x632be59bd9b4e019ULL)));
+    Ops.push_back(B.CreateTrunc(B.CreateSelect(IsEdge, Edge, Random), Ty));
+  }
+  if (isShift(*J.R))
+    Ops[1] = B.CreateURem(Ops[1], ConstantInt::get(Ty, J.Bits));
+  return Ops;
+}
+
+// The pattern of R alone, as a rule
+Rule getPatternRule(const Rule &R) {
+  Rule P = R;
+  P.Code.clear();
+  for (unsigned I = 0; I < getArity(R); ++I)
+    P.Code.push_back({StepKind(StepX + I), 0});
+  P.Code.push_back({R.Kind, R.Imm});
+  return P;
+}
+
+// R as a function of its operands, returning its result zero-extended to
+// i64. The pattern and the rule each get one that cannot be inlined: in the
+// same function, InstCombine or GVN could rewrite the rule into the pattern
+// and the check would pass without running the rule
+Function *emitRuleFunction(Module &M, const Rule &R, Type *Ty,
+                           const Twine &Name) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I64 = Type::getInt64Ty(Ctx);
+  SmallVector<Type *, 3> Params(getArity(R), Ty);
+  Function *F = Function::Create(FunctionType::get(I64, Params, false),
+                                 GlobalValue::ExternalLinkage, Name, &M);
+  F->addFnAttr(Attribute::NoInline);
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+  SmallVector<Value *, 3> Ops;
+  for (Argument &A : F->args())
+    Ops.push_back(&A);
+  B.CreateRet(B.CreateZExtOrBitCast(emitRule(R, B, Ops), I64));
+  return F;
+}
+
+void emitJob(Module &M, Job &J, unsigned Id) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I64 = Type::getInt64Ty(Ctx);
+  Rule Pattern = getPatternRule(*J.R);
+  Type *Ty = Type::getIntNTy(Ctx, J.Bits);
+  Function *PatternF =
+      emitRuleFunction(M, Pattern, Ty, "pattern" + Twine(Id));
+  Function *RuleF = emitRuleFunction(M, *J.R, Ty, "rule" + Twine(Id));
+
+  // uint64_t count(uint64_t Begin, uint64_t End)
+  auto *CountTy = FunctionType::get(I64, {I64, I64}, false);
+  Function *Count = Function::Create(CountTy, GlobalValue::ExternalLinkage,
+                                     "count" + Twine(Id), &M);
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Count);
+  BasicBlock *Loop = BasicBlock::Create(Ctx, "loop", Count);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", Count);
+  IRBuilder<> B(Entry);
+  Value *Begin = Count->getArg(0);
+  Value *End = Count->getArg(1);
+  B.CreateCondBr(B.CreateICmpULT(Begin, End), Loop, Exit);
+
+  B.SetInsertPoint(Loop);
+  PHINode *Index = B.CreatePHI(I64, 2);
+  PHINode *Failures = B.CreatePHI(I64, 2);
+  SmallVector<Value *, 3> Ops = emitDecode(B, M, J, Index);
+  Value *Expected = B.CreateCall(PatternF, Ops);
+  Value *Actual = B.CreateCall(RuleF, Ops);
+  Value *Failed = B.CreateZExt(B.CreateICmpNE(Expected, Actual), I64);
+  Value *NextFailures = B.CreateAdd(Failures, Failed);
+  Value *Next = B.CreateAdd(Index, ConstantInt::get(I64, 1));
+  B.CreateCondBr(B.CreateICmpULT(Next, End), Loop, Exit);
+  Index->addIncoming(Begin, Entry);
+  Index->addIncoming(Next, Loop);
+  Failures->addIncoming(ConstantInt::get(I64, 0), Entry);
+  Failures->addIncoming(NextFailures, Loop);
+
+  B.SetInsertPoint(Exit);
+  PHINode *Result = B.CreatePHI(I64, 2);
+  Result->addIncoming(ConstantInt::get(I64, 0), Entry);
+  Result->addIncoming(NextFailures, Loop);
+  B.CreateRet(Result);
+
+  // void decode(uint64_t Index, uint64_t *Ops)
+  auto *DecodeTy = FunctionType::get(
+      Type::getVoidTy(Ctx), {I64, PointerType::getUnqual(I64)}, false);
+  Function *Decode = Function::Create(DecodeTy, GlobalValue::ExternalLinkage,
+                                      "decode" + Twine(Id), &M);
+  B.SetInsertPoint(BasicBlock::Create(Ctx, "entry", Decode));
+  Ops = emitDecode(B, M, J, Decode->getArg(0));
+  for (unsigned I = 0; I < Ops.size(); ++I)
+    B.CreateStore(B.CreateZExt(Ops[I], I64),
+                  B.CreateConstInBoundsGEP1_64(I64, Decode->getArg(1), I));
+  B.CreateRetVoid();
+}
+
+void optimize(Module &M, TargetMachine *TM) {
+  legacy::FunctionPassManager FPM(&M);
+  legacy::PassManager MPM;
+  FPM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+  MPM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+  PassManagerBuilder PMB;
+  PMB.OptLevel = 2;
+  PMB.LoopVectorize = true;
+  PMB.SLPVectorize = true;
+  PMB.populateFunctionPassManager(FPM);
+  PMB.populateModulePassManager(MPM);
+  FPM.doInitialization();
+  for (Function &F : M)
+    FPM.run(F);
+  FPM.doFinalization();
+  MPM.run(M);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Check the MBA rules\n");
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  auto Start = std::chrono::steady_clock::now();
+
+  // The rules of the table, then the generated ones, named Linear<n>
+  std::vector<const Rule *> Rules;
+  for (const Rule &R : getRules())
+    Rules.push_back(&R);
+  std::deque<Rule> Linear;
+  std::deque<std::string> LinearTexts;
+  std::mt19937 Rng(1);
+  const unsigned LinearOpcodes[] = {Instruction::Add, Instruction::Sub,
+                                    Instruction::And, Instruction::Or,
+                                    Instruction::Xor};
+  for (unsigned Opcode : LinearOpcodes)
+    for (unsigned I = 0; I < LinearRules; ++I) {
+      Linear.emplace_back();
+      LinearTexts.emplace_back();
+      makeLinearRule(Opcode, 0, Rng, Linear.back(), LinearTexts.back());
+      LinearTexts.push_back("Linear" + std::to_string(Linear.size()));
+      Linear.back().Name = LinearTexts.back().c_str();
+      Rules.push_back(&Linear.back());
+    }
+
+  std::vector<std::unique_ptr<Job>> Jobs;
+  for (const Rule *Next : Rules) {
+    const Rule &R = *Next;
+    if (!OnlyRule.empty() && OnlyRule != R.Name)
+      continue;
+    for (unsigned Bits : getCheckedWidths(R)) {
+      auto J = std::make_unique<Job>();
+      J->R = &R;
+      J->Bits = Bits;
+      unsigned InputBits = Bits * getArity(R);
+      J->Exhaustive = Bits <= ExhaustiveBits && InputBits <= 32;
+      if (J->Exhaustive && isShift(R))
+        J->Inputs = (1ULL << Bits) * Bits;
+      else if (J->Exhaustive)
+        J->Inputs = 1ULL << InputBits;
+      else
+        J->Inputs = 1ULL << SampleLog;
+      // Trying the edge values at least
+      if (!J->Exhaustive)
+        J->Inputs = std::max<uint64_t>(J->Inputs, EdgeCount * EdgeCount *
+                                                      EdgeCount);
+      J->Name = (Twine(R.Name) + " i" + Twine(Bits)).str();
+      Jobs.push_back(std::move(J));
+    }
+  }
+  if (Jobs.empty()) {
+    errs() << "MbaVerify: no rule to check\n";
+    return 1;
+  }
+
+  // One module for all the rules, compiled once
+  LLVMContext Ctx;
+  auto Owner = std::make_unique<Module>("mba-verify", Ctx);
+  Module *M = Owner.get();
+  for (unsigned I = 0; I < Jobs.size(); ++I)
+    emitJob(*M, *Jobs[I], I);
+  if (verifyModule(*M, &errs()))
+    return 1;
+
+  std::string Error;
+  std::unique_ptr<ExecutionEngine> EE(
+      EngineBuilder(std::move(Owner))
+          .setEngineKind(EngineKind::JIT)
+          .setErrorStr(&Error)
+          .setOptLevel(CodeGenOpt::Aggressive)
+          .setMCPU(sys::getHostCPUName())
+          .create());
+  if (!EE) {
+    errs() << "MbaVerify: " << Error << "\n";
+    return 1;
+  }
+  optimize(*M, EE->getTargetMachine());
+  for (unsigned I = 0; I < Jobs.size(); ++I) {
+    Jobs[I]->Count = (CountFn)EE->getFunctionAddress("count" + std::to_string(I));
+    Jobs[I]->Decode =
+        (DecodeFn)EE->getFunctionAddress("decode" + std::to_string(I));
+  }
+  EE->finalizeObject();
+
+  // Chunks of at most 2^24 inputs, taken in order by the threads
+  const uint64_t ChunkSize = 1 << 24;
+  std::vector<std::pair<Job *, uint64_t>> Chunks;
+  for (auto &J : Jobs)
+    for (uint64_t Begin = 0; Begin < J->Inputs; Begin += ChunkSize)
+      Chunks.push_back({J.get(), Begin});
+  std::atomic<size_t> NextChunk{0};
+  auto Work = [&]() {
+    for (size_t C = NextChunk++; C < Chunks.size(); C = NextChunk++) {
+      Job &J = *Chunks[C].first;
+      uint64_t Begin = Chunks[C].second;
+      uint64_t End = std::min(Begin + ChunkSize, J.Inputs);
+      uint64_t Failures = J.Count(Begin, End);
+      if (!Failures)
+        continue;
+      J.Failures += Failures;
+      // Find the first failing input of the chunk
+      for (uint64_t I = Begin; I < End; ++I)
+        if (J.Count(I, I + 1)) {
+          uint64_t First = J.FirstFailure;
+          while (I < First && !J.FirstFailure.compare_exchange_weak(First, I))
+            ;
+          break;
+        }
+    }
+  };
+  unsigned ThreadCount = Threads ? Threads : std::thread::hardware_concurrency();
+  std::vector<std::thread> Pool;
+  for (unsigned I = 1; I < std::max(ThreadCount, 1u); ++I)
+    Pool.emplace_back(Work);
+  Work();
+  for (std::thread &T : Pool)
+    T.join();
+
+  unsigned Failed = 0;
+  uint64_t Checked = 0;
+  for (auto &J : Jobs) {
+    Checked += J->Inputs;
+    if (!J->Failures)
+      continue;
+    ++Failed;
+    uint64_t Ops[3] = {0, 0, 0};
+    J->Decode(J->FirstFailure, Ops);
+    outs() << "FAIL " << J->Name << ": " << J->R->Pattern << " != "
+           << J->R->Expr << ", " << J->Failures << " of " << J->Inputs
+           << " inputs, first at x = " << Ops[0] << ", y = " << Ops[1];
+    if (getArity(*J->R) == 3)
+      outs() << ", z = " << Ops[2];
+    outs() << "\n";
+  }
+  double Seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - Start)
+                       .count();
+  outs() << Jobs.size() << " rule widths, " << Checked << " inputs, "
+         << Failed << " failed, " << format("%.1f", Seconds) << " s on "
+         << ThreadCount << " threads\n";
+  return Failed ? 1 : 0;
+}
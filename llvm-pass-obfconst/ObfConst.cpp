@@ -1,9 +1,14 @@
 // Based on
 // https://blog.quarkslab.com/turning-regular-code-into-atrocities-with-llvm.html
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/IR/LegacyPassManager.h"
@@ -14,43 +19,168 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/NoFolder.h"
 
-#include <boost/integer/mod_inverse.hpp>
-
 #include <random>
+
+#include "ObfConstTables.h"
 using namespace llvm;
 
+enum PoolKind { PoolNone, PoolFunction, PoolLoop };
+
+static cl::opt<PoolKind> Pool(
+    "obfconst_pool",
+    cl::desc("Choose how many times each obfuscated constant is decoded"),
+    cl::values(clEnumValN(PoolNone, "none", "Decode the constant at every use"),
+               clEnumValN(PoolFunction, "function",
+                          "Decode each distinct constant once per function, "
+                          "in the entry block"),
+               clEnumValN(PoolLoop, "loop",
+                          "Decode each distinct constant used in a loop "
+                          "once, in the preheader of the outermost loop, "
+                          "and the others at every use")),
+    cl::init(PoolNone), cl::Optional);
+
+static cl::opt<bool> LiveValues(
+    "obfconst_live",
+    cl::desc("Build the zero-valued expression of each encoding from integer "
+             "values computed by the function, instead of literals"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<bool> Report(
+    "obfconst_report",
+    cl::desc("Print the number of encoded constants of each function, and "
+             "how many are built on live values"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<bool> Tables(
+    "obfconst_tables",
+    cl::desc("Store the constant integer tables encoded, and decode them "
+             "once, on their first use"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<unsigned> TableMin(
+    "obfconst_table_min",
+    cl::desc("Smallest number of elements of the tables encoded by "
+             "-obfconst_tables"),
+    cl::init(16), cl::Optional);
+
+static cl::opt<bool> Switches(
+    "obfconst_switch",
+    cl::desc("Transform the condition of the switches with a bijection and "
+             "re-key their cases"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<bool> GepOffsets(
+    "obfconst_gep",
+    cl::desc("Replace the constant offsets of the getelementptr instructions "
+             "with encoded byte offsets"),
+    cl::init(false), cl::Optional);
+
+// Live values one encoding picks from, the most recent ones available
+static const unsigned LiveWindow = 64;
+
 namespace {
 
-class ObfConstPass : public BasicBlockPass {
+class ObfConstPass : public FunctionPass {
   std::vector<Value *> IntegerVect;
   std::default_random_engine Generator;
+  // Decoded constants of the current function, by the block they are
+  // decoded in
+  DenseMap<std::pair<BasicBlock *, Constant *>, Value *> Decoded;
+  // Where -obfconst_pool=function decodes, after the allocas of the entry
+  // block
+  Instruction *EntryPoint = nullptr;
+  LoopInfo *LI = nullptr;
+  DominatorTree *DT = nullptr;
+  // Encodings of the current function, and those built on live values
+  unsigned Encoded = 0;
+  unsigned EncodedLive = 0;
+  // Re-keyed switches and rewritten getelementptr of the current function
+  unsigned SwitchCount = 0;
+  unsigned GepCount = 0;
 
 public:
   static char ID;
 
   // Constructor
-  ObfConstPass() : BasicBlockPass(ID) {}
+  ObfConstPass() : FunctionPass(ID) {}
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.setPreservesCFG();
+  }
+
+  virtual bool doInitialization(Module &M) {
+    if (!Tables)
+      return false;
+    unsigned Count = obfconst::encodeTables(M, TableMin);
+    if (Report)
+      errs() << "obfconst: " << Count << " encoded tables\n";
+    return Count != 0;
+  }
 
-  virtual bool runOnBasicBlock(BasicBlock &BB) {
+  virtual bool runOnFunction(Function &F) {
+    LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    Decoded.clear();
+    Encoded = EncodedLive = SwitchCount = GepCount = 0;
+    // The values are kept for the whole function, the encodings only pick
+    // those dominating their insertion point
     IntegerVect.clear();
+    for (Argument &Arg : F.args())
+      registerInteger(Arg);
+    BasicBlock::iterator Entry = F.getEntryBlock().getFirstInsertionPt();
+    while (isa<AllocaInst>(*Entry))
+      ++Entry;
+    EntryPoint = &*Entry;
+
+    // Take the instructions of every block first: the pooled constants are
+    // decoded in the entry block and in the preheaders, where the decoding
+    // must not be obfuscated again
+    std::vector<std::vector<Instruction *>> Blocks;
+    for (BasicBlock &BB : F) {
+      Blocks.emplace_back();
+      for (PHINode &Phi : BB.phis())
+        registerInteger(Phi);
+      // All non-PHI instructions (not from beggining)
+      for (auto I = BB.getFirstInsertionPt(), end = BB.end(); I != end; ++I)
+        Blocks.back().push_back(&*I);
+    }
+
+    bool modified = false;
+    for (std::vector<Instruction *> &Insts : Blocks)
+      modified |= runOnBasicBlock(Insts);
+
+    if (Report)
+      errs() << "obfconst: " << F.getName() << ": " << Encoded
+             << " encoded constants, " << EncodedLive << " on live values, "
+             << SwitchCount << " switches, " << GepCount
+             << " getelementptr\n";
+    return modified;
+  }
+
+  bool runOnBasicBlock(ArrayRef<Instruction *> Insts) {
     bool modified = false;
 
-    // Iterator over all non-PHI instructions (not from beggining)
-    for (typename BasicBlock::iterator I = BB.getFirstInsertionPt(),
-                                       end = BB.end();
-         I != end; ++I) {
+    for (Instruction *I : Insts) {
       Instruction &Inst = *I;
+      if (auto *SI = dyn_cast<SwitchInst>(&Inst)) {
+        if (Switches)
+          modified |= obfuscateSwitch(*SI);
+        continue;
+      }
+      if (auto *GEP = dyn_cast<GetElementPtrInst>(&Inst)) {
+        // Erases GEP when it is rewritten
+        if (GepOffsets)
+          modified |= obfuscateGep(*GEP);
+        continue;
+      }
       if (isValidCandidateInstruction(Inst)) {
         // Iterate over operands
         for (size_t i = 0; i < Inst.getNumOperands(); ++i) {
-          if (Constant *C = isValidCandidateOperand(Inst.getOperand(i))) {
-            if (Value *New_val = replaceConst(Inst, C)) {
-              Inst.setOperand(i, New_val);
-              modified = true;
-            } else {
-              errs() << "ObfConstPass: could not rand pick a variable for "
-                        "replacement\n";
-            }
+          if (ConstantInt *C = isValidCandidateOperand(Inst.getOperand(i))) {
+            Inst.setOperand(i, getDecoded(Inst, C));
+            modified = true;
           }
         }
       }
@@ -60,42 +190,71 @@ public:
   }
 
 private:
-  Value *replaceConst(Instruction &Inst, Constant *C) {
+  // The decoded value of C for its use in Inst. With -obfconst_pool, the
+  // uses below the same pool point share one decoding
+  Value *getDecoded(Instruction &Inst, ConstantInt *C) {
+    Instruction *InsertPt = getPoolPoint(Inst);
+    if (!InsertPt)
+      return replaceConst(Inst, C);
+    Value *&Pooled = Decoded[{InsertPt->getParent(), C}];
+    if (!Pooled)
+      Pooled = replaceConst(*InsertPt, C);
+    return Pooled;
+  }
+
+  // Where the constants used by Inst are decoded once for all their uses,
+  // or nullptr to decode them right before Inst
+  Instruction *getPoolPoint(Instruction &Inst) {
+    switch (Pool) {
+    case PoolNone:
+      return nullptr;
+    case PoolFunction:
+      return EntryPoint;
+    case PoolLoop: {
+      // The preheader of the outermost loop, which runs once per execution
+      // of the whole loop nest
+      BasicBlock *Preheader = nullptr;
+      for (Loop *L = LI->getLoopFor(Inst.getParent()); L;
+           L = L->getParentLoop())
+        if (BasicBlock *BB = L->getLoopPreheader())
+          Preheader = BB;
+      return Preheader ? Preheader->getTerminator() : nullptr;
+    }
+    }
+    return nullptr;
+  }
+
+  // Encodes C with the affine map f(x) = a * x + b and decodes it with its
+  // inverse g(x) = a_inv * x - a_inv * b, both in the width of C: every
+  // operation wraps modulo 2^n, so no remainder or extension is needed.
+  // The encoded value is hidden behind E, which is always zero
+  Value *replaceConst(Instruction &Inst, ConstantInt *C) {
     std::random_device dev;
     std::mt19937 rng(dev());
-    std::uniform_int_distribution<std::mt19937::result_type> dist(1, INT32_MAX);
-    auto &ctx = Inst.getParent()->getContext();
-    Type *i32_type = llvm::IntegerType::getInt32Ty(ctx); // TODO: 32 vs 64?
-    uint32_t mod = static_cast<long>(INT32_MAX) + 1;
+    std::uniform_int_distribution<uint64_t> dist;
+    IntegerType *Ty = C->getType();
+    unsigned Bits = Ty->getBitWidth();
+    auto random = [&]() { return APInt(64, dist(rng)).zextOrTrunc(Bits); };
 
     IRBuilder<NoFolder> Builder(&Inst);
 
-    uint32_t a_inv = 0;
-    uint32_t a;
-    while (a_inv == 0) {
-      a = dist(rng);
-      if (a % 2 == 0) {
-        a = a / 2;
-      }
-      a_inv = boost::integer::mod_inverse(static_cast<long>(a),
-                                          static_cast<long>(mod));
-    }
-
-    uint32_t b = dist(rng);
-    uint32_t x = dist(rng);
-    uint32_t y = dist(rng);
+    // a is odd, so it is invertible modulo 2^n
+    APInt a = random();
+    a.setBit(0);
+    APInt a_inv = obfconst::inverse(a);
+    APInt b = random();
 
-    Constant *constA = ConstantInt::get(i32_type, a);
-    Constant *constB = ConstantInt::get(i32_type, b);
-    Constant *constX = ConstantInt::get(i32_type, x);
-    Constant *constY = ConstantInt::get(i32_type, y);
+    Value *constX = ConstantInt::get(Ty, random());
+    Value *constY = ConstantInt::get(Ty, random());
+    // E is zero for any x and y, on values the optimizer does not know it
+    // cannot fold back
+    if (LiveValues && pickLiveValues(Inst, Ty, constX, constY, rng))
+      ++EncodedLive;
+    ++Encoded;
 
-    // fx = ax + b (mod uint32_max)
-    uint32_t fC_ax = a * C->getUniqueInteger().getLimitedValue();
-    errs() << "\n"
-           << "fC_ax= " << fC_ax << "\n";
-
-    Value *fC = Builder.CreateAdd(ConstantInt::get(i32_type, fC_ax), constB);
+    // f(C) = a * C + b
+    Value *fC = Builder.CreateAdd(ConstantInt::get(Ty, a * C->getValue()),
+                                  ConstantInt::get(Ty, b));
     fC->setName("fC");
 
     // E= x + y − (x | y) − (~x | y) + (~x)
@@ -107,28 +266,173 @@ private:
     Value *E = Builder.CreateAdd(E_12, Builder.CreateNot(constX));
     E->setName("E");
 
-    // g(E + f(C)) = C
-    // g(x) = a_inv*(E + f(C)) + (-a_inv * b)
-    uint64_t g_b = (-a_inv * b) % mod;
-    errs() << "\n"
-           << "a_inv: " << a_inv << "\ng_b= " << g_b << "\n";
-
-    Value *E_fC = Builder.CreateAdd(E, fC);
+    // Added to f(C), E would let InstCombine distribute the multiplication
+    // of g, and fold a_inv * f(C) - a_inv * b back to C next to a_inv * E.
+    // It cannot distribute it over a xor
+    Value *E_fC = Builder.CreateXor(E, fC);
     E_fC->setName("E_fC");
 
-    Value *NewVal = Builder.CreateAdd(
-        Builder.CreateMul(ConstantInt::get(i32_type, a_inv), E_fC),
-        ConstantInt::get(i32_type, g_b));
-
-    errs() << ConstantInt::get(i32_type, g_b)->getUniqueInteger() << '\n';
+    // g(E ^ f(C)) = a_inv * (E ^ f(C)) - a_inv * b = C
+    Value *NewVal =
+        Builder.CreateAdd(Builder.CreateMul(ConstantInt::get(Ty, a_inv), E_fC),
+                          ConstantInt::get(Ty, -(a_inv * b)));
     NewVal->setName("NewVal");
+    // Marks the decoded value, testing/obfconst/survive.sh counts those left
+    // after -O2
+    cast<Instruction>(NewVal)->setMetadata("obfconst",
+                                           MDNode::get(Ty->getContext(), None));
+    return NewVal;
+  }
+
+  // Replaces the condition v of SI with (v ^ k) + t and every case c with
+  // (c ^ k) + t. k is below the size of the aligned block holding the
+  // cases, so it only permutes them inside the block, and is kept when the
+  // span of the cases does not grow. t moves them without crossing the
+  // signed wrap, where the backend would split them. The cases stay as
+  // dense as before and the backend still emits a jump table for them. t is
+  // decoded like the other constants: as a literal, InstCombine would fold
+  // it back into the cases
+  bool obfuscateSwitch(SwitchInst &SI) {
+    auto *Ty = dyn_cast<IntegerType>(SI.getCondition()->getType());
+    if (!Ty || Ty->getBitWidth() < 8 || SI.getNumCases() == 0)
+      return false;
+    LLVMContext &Ctx = Ty->getContext();
+    unsigned Bits = Ty->getBitWidth();
+    std::random_device dev;
+    std::mt19937 rng(dev());
+    std::uniform_int_distribution<uint64_t> dist;
+    auto random = [&]() { return APInt(64, dist(rng)).zextOrTrunc(Bits); };
+
+    // The bits above Block are the same in every case
+    APInt First = SI.case_begin()->getCaseValue()->getValue();
+    APInt Diff(Bits, 0);
+    for (auto Case : SI.cases())
+      Diff |= Case.getCaseValue()->getValue() ^ First;
+    unsigned Block = Bits - Diff.countLeadingZeros();
+    // The signed span of the cases, as ordered by the backend, after
+    // applying K and T
+    auto span = [&](const APInt &K, const APInt &T, APInt &Lo, APInt &Hi) {
+      Lo = Hi = (First ^ K) + T;
+      for (auto Case : SI.cases()) {
+        APInt V = (Case.getCaseValue()->getValue() ^ K) + T;
+        if (V.slt(Lo))
+          Lo = V;
+        if (V.sgt(Hi))
+          Hi = V;
+      }
+    };
+    APInt Zero(Bits, 0), Lo(Bits, 0), Hi(Bits, 0);
+    span(Zero, Zero, Lo, Hi);
+    APInt Width = Hi - Lo;
+
+    APInt k = Zero;
+    for (unsigned Try = 0; Try < 8 && k == 0; ++Try) {
+      APInt K = random() & APInt::getLowBitsSet(Bits, Block);
+      span(K, Zero, Lo, Hi);
+      if ((Hi - Lo).ule(Width))
+        k = K;
+    }
+    span(k, Zero, Lo, Hi);
+    APInt t = Zero;
+    for (unsigned Try = 0; Try < 8 && t == 0; ++Try) {
+      APInt T = random();
+      if ((Lo + T).sle(Hi + T))
+        t = T;
+    }
+    if (k == 0 && t == 0)
+      return false;
+
+    IRBuilder<NoFolder> Builder(&SI);
+    Value *Cond = SI.getCondition();
+    if (k != 0)
+      Cond = Builder.CreateXor(Cond, ConstantInt::get(Ty, k));
+    if (t != 0)
+      Cond = Builder.CreateAdd(Cond,
+                               getDecoded(SI, ConstantInt::get(Ctx, t)));
+    Cond->setName("Key");
+    SI.setCondition(Cond);
+    for (auto Case : SI.cases())
+      Case.setValue(
+          ConstantInt::get(Ctx, (Case.getCaseValue()->getValue() ^ k) + t));
+    ++SwitchCount;
+    return true;
+  }
+
+  // Replaces a getelementptr whose indices are all constant with an i8
+  // getelementptr on its decoded byte offset. The address is then a base
+  // plus a register, which still folds into the addressing mode of the
+  // loads and stores. With a variable index already there, the offset would
+  // take an extra add, so those are left alone, and so are the struct
+  // fields of allocas, which SROA could not split any more
+  bool obfuscateGep(GetElementPtrInst &GEP) {
+    if (!GEP.hasAllConstantIndices() || GEP.getType()->isVectorTy())
+      return false;
+    if (isa<AllocaInst>(
+            GEP.getPointerOperand()->stripInBoundsConstantOffsets()))
+      return false;
+    const DataLayout &DL = GEP.getModule()->getDataLayout();
+    unsigned AS = GEP.getPointerAddressSpace();
+    APInt Offset(DL.getIndexSizeInBits(AS), 0);
+    if (!GEP.accumulateConstantOffset(DL, Offset) || Offset == 0)
+      return false;
 
-    Value *res1 = Builder.CreateURem(NewVal, ConstantInt::get(i32_type, mod));
-    Value *res = Builder.CreateZExtOrTrunc(
-        res1, llvm::IntegerType::getInt32Ty(ctx), "Result");
-    errs() << "a= " << a << "\n"
-           << "b= " << b << '\n';
-    return res;
+    IRBuilder<NoFolder> Builder(&GEP);
+    Value *Base = Builder.CreateBitCast(GEP.getPointerOperand(),
+                                        Builder.getInt8PtrTy(AS));
+    Value *Off = getDecoded(GEP, ConstantInt::get(GEP.getContext(), Offset));
+    Type *I8 = Builder.getInt8Ty();
+    Value *Addr = GEP.isInBounds() ? Builder.CreateInBoundsGEP(I8, Base, Off)
+                                   : Builder.CreateGEP(I8, Base, Off);
+    Addr = Builder.CreateBitCast(Addr, GEP.getType());
+    Addr->takeName(&GEP);
+    GEP.replaceAllUsesWith(Addr);
+    // The next pooled constants go after the new getelementptr
+    if (EntryPoint == &GEP)
+      EntryPoint = GEP.getNextNode();
+    GEP.eraseFromParent();
+    ++GepCount;
+    return true;
+  }
+
+  // Picks X and Y among the registered values of type Ty that are available
+  // at InsertPt, among the most recent ones. Leaves them unchanged and
+  // returns false when there are none
+  bool pickLiveValues(Instruction &InsertPt, Type *Ty, Value *&X, Value *&Y,
+                      std::mt19937 &rng) {
+#if LLVM_VERSION_MAJOR < 10
+    // E is only zero on values that are neither undef nor poison, and
+    // freeze, which makes sure of it, came with LLVM 10
+    return false;
+#else
+    std::vector<Value *> Live;
+    for (auto V = IntegerVect.rbegin(), E = IntegerVect.rend();
+         V != E && Live.size() < LiveWindow; ++V) {
+      if ((*V)->getType() != Ty)
+        continue;
+      if (auto *Def = dyn_cast<Instruction>(*V))
+        if (Def == &InsertPt || !DT->dominates(Def, &InsertPt))
+          continue;
+      Live.push_back(*V);
+    }
+    if (Live.empty())
+      return false;
+    // With X == Y the expression folds whatever the value, so a single live
+    // value is paired with the literal Y
+    std::uniform_int_distribution<size_t> pick(0, Live.size() - 1);
+    size_t i = pick(rng);
+    // An undef PHI incoming value or an overflowing nsw add would make E
+    // non-zero, each use of undef can take a different value. Frozen, they
+    // take one, and InstCombine drops the freeze of the other values
+    IRBuilder<NoFolder> Builder(&InsertPt);
+    X = Builder.CreateFreeze(Live[i]);
+    if (Live.size() > 1) {
+      size_t j = pick(rng);
+      while (j == i)
+        j = pick(rng);
+      Y = Builder.CreateFreeze(Live[j]);
+    }
+    return true;
+#endif
   }
 
   bool isValidCandidateInstruction(Instruction &Inst) {
@@ -138,34 +442,32 @@ private:
       return false;
     } else if (isa<CallInst>(&Inst)) { // Ignore calls
       return false;
+    } else if (isa<AllocaInst>(&Inst)) { // Keep the allocas static
+      return false;
     } else {
       // errs() << "Valid instruction: " << Inst << "\n";
       return true;
     }
   }
 
-  Constant *isValidCandidateOperand(Value *V) {
-    Constant *C;
+  ConstantInt *isValidCandidateOperand(Value *V) {
+    ConstantInt *C;
     // errs() << "Checking operand: " << V << "\n";
-    // Is it a constant (== literal)?
-    if (!(C = dyn_cast<Constant>(V)))
+    // Is it an integer literal?
+    if (!(C = dyn_cast<ConstantInt>(V)))
       return nullptr;
     // Ignore 0
     // if (C->isNullValue()) return nullptr;
-    // We found a constant, check if it's an integer
-    if (!C->getType()->isIntegerTy())
-      return nullptr;
     // Ignore 1
     // if (C->getUniqueInteger().getLimitedValue() == 1) return nullptr;
-    if (C->getUniqueInteger().isNegative())
-      return nullptr;
-    if (C->getType()->getScalarSizeInBits() != 32)
+    // Booleans have a single odd multiplier, the encoding would not hide
+    // anything
+    if (C->getBitWidth() < 8)
       return nullptr;
-    errs() << "Value: " << C->getUniqueInteger().getLimitedValue() << "\n ";
     return C;
   }
 
-  // Possibly use this instead of random numbers
+  // Values that -obfconst_live builds the encodings on
   void registerInteger(Value &V) {
     if (V.getType()->isIntegerTy()) {
       IntegerVect.push_back(&V);
@@ -0,0 +1,256 @@
+#include "ObfConstTables.h"
+
+#include <random>
+#include <vector>
+
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+
+using namespace llvm;
+
+namespace obfconst {
+
+namespace {
+
+// Cache line the decoded tables are aligned to
+const unsigned TableAlign = 64;
+
+// An encoded table: element i is stored as a * x_i + b + i * d
+struct Table {
+  GlobalVariable *Encoded;
+  GlobalVariable *Decoded;
+  APInt AInv, B, D;
+};
+
+// LLVM 10 replaced the alignments in bytes with llvm::Align
+#if LLVM_VERSION_MAJOR < 10
+unsigned toAlign(uint64_t Bytes) { return Bytes; }
+#else
+Align toAlign(uint64_t Bytes) { return Align(Bytes); }
+#endif
+
+// Adds the functions reading C to Users. Returns false if C is also used
+// outside of a function, by a global initializer or llvm.used
+bool collectUsers(Constant *C, SmallSetVector<Function *, 8> &Users) {
+  for (User *U : C->users()) {
+    if (auto *I = dyn_cast<Instruction>(U))
+      Users.insert(I->getFunction());
+    else if (!isa<ConstantExpr>(U) ||
+             !collectUsers(cast<ConstantExpr>(U), Users))
+      return false;
+  }
+  return true;
+}
+
+// The initializer of GV if it is a table the pass can encode
+ConstantDataArray *getTable(GlobalVariable &GV, unsigned MinElements) {
+  // Tables visible from other modules must keep their value
+  if (!GV.isConstant() || !GV.hasInitializer() || !GV.hasLocalLinkage() ||
+      GV.isThreadLocal())
+    return nullptr;
+  auto *Init = dyn_cast<ConstantDataArray>(GV.getInitializer());
+  if (!Init || Init->getNumElements() < MinElements)
+    return nullptr;
+  // Same as the operands, booleans are left alone
+  auto *EltTy = dyn_cast<IntegerType>(Init->getElementType());
+  if (!EltTy || EltTy->getBitWidth() < 8)
+    return nullptr;
+  return Init;
+}
+
+// Replaces GV with a zero-filled, writable table and returns the encoding
+Table encodeTable(GlobalVariable &GV, ConstantDataArray &Init,
+                  std::mt19937 &rng) {
+  std::uniform_int_distribution<uint64_t> dist;
+  unsigned Bits = Init.getElementType()->getIntegerBitWidth();
+  auto random = [&]() { return APInt(64, dist(rng)).zextOrTrunc(Bits); };
+
+  APInt a = random();
+  a.setBit(0);
+  APInt b = random(), d = random();
+
+  // The key b + i * d changes with every element, so equal values of the
+  // table are not equal once encoded
+  SmallVector<Constant *, 256> Elts;
+  APInt Key = b;
+  for (unsigned i = 0, e = Init.getNumElements(); i != e; ++i, Key += d)
+    Elts.push_back(ConstantInt::get(Init.getElementType(),
+                                    a * Init.getElementAsAPInt(i) + Key));
+
+  Module &M = *GV.getParent();
+  ArrayType *Ty = Init.getType();
+  auto *Encoded = new GlobalVariable(
+      M, Ty, true, GlobalValue::PrivateLinkage, ConstantArray::get(Ty, Elts),
+      GV.getName() + ".enc", &GV, GlobalValue::NotThreadLocal,
+      GV.getType()->getAddressSpace());
+  auto *Decoded = new GlobalVariable(
+      M, Ty, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(Ty), "", &GV, GlobalValue::NotThreadLocal,
+      GV.getType()->getAddressSpace());
+  Decoded->takeName(&GV);
+  Decoded->setAlignment(
+      toAlign(std::max<uint64_t>(TableAlign, GV.getAlignment())));
+  GV.replaceAllUsesWith(Decoded);
+  GV.eraseFromParent();
+  return {Encoded, Decoded, inverse(a), b, d};
+}
+
+// Emits the loop decoding T at the end of BB, and returns the block after it
+BasicBlock *emitDecodeLoop(BasicBlock *BB, const Table &T) {
+  LLVMContext &Ctx = BB->getContext();
+  Function *F = BB->getParent();
+  auto *Ty = cast<ArrayType>(T.Decoded->getValueType());
+  Type *EltTy = Ty->getElementType();
+  Type *IdxTy = Type::getInt64Ty(Ctx);
+  BasicBlock *Loop = BasicBlock::Create(Ctx, "decode", F);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "decoded", F);
+  IRBuilder<> Builder(BB);
+  Builder.CreateBr(Loop);
+
+  // x_i = a_inv * (e_i - (b + i * d))
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(IdxTy, 2, "i");
+  PHINode *Key = Builder.CreatePHI(EltTy, 2, "key");
+  Value *Zero = ConstantInt::get(IdxTy, 0);
+  Value *Src = Builder.CreateInBoundsGEP(Ty, T.Encoded, {Zero, Idx});
+  Value *Dst = Builder.CreateInBoundsGEP(Ty, T.Decoded, {Zero, Idx});
+  Value *Enc = Builder.CreateLoad(EltTy, Src);
+  Builder.CreateStore(
+      Builder.CreateMul(ConstantInt::get(EltTy, T.AInv),
+                        Builder.CreateSub(Enc, Key)),
+      Dst);
+  Value *NextIdx = Builder.CreateAdd(Idx, ConstantInt::get(IdxTy, 1));
+  Value *NextKey = Builder.CreateAdd(Key, ConstantInt::get(EltTy, T.D));
+  Builder.CreateCondBr(
+      Builder.CreateICmpULT(NextIdx,
+                            ConstantInt::get(IdxTy, Ty->getNumElements())),
+      Loop, Exit);
+  Idx->addIncoming(Zero, BB);
+  Idx->addIncoming(NextIdx, Loop);
+  Key->addIncoming(ConstantInt::get(EltTy, T.B), BB);
+  Key->addIncoming(NextKey, Loop);
+  return Exit;
+}
+
+// The function decoding every table once. The first caller to swap Claimed
+// from 0 to 1 decodes and sets Ready, the other callers wait for Ready
+Function *createDecoder(Module &M, ArrayRef<Table> Tables,
+                        GlobalVariable *Ready) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I8 = Type::getInt8Ty(Ctx);
+  auto *Claimed =
+      new GlobalVariable(M, I8, false, GlobalValue::InternalLinkage,
+                         ConstantInt::get(I8, 0), "obfconst.claimed");
+  Function *Decoder = Function::Create(
+      FunctionType::get(Type::getVoidTy(Ctx), false),
+      GlobalValue::InternalLinkage, "obfconst.decode", &M);
+  Decoder->addFnAttr(Attribute::NoInline);
+  Decoder->addFnAttr(Attribute::Cold);
+
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Decoder);
+  BasicBlock *Decode = BasicBlock::Create(Ctx, "claimed", Decoder);
+  BasicBlock *Wait = BasicBlock::Create(Ctx, "wait", Decoder);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", Decoder);
+  IRBuilder<> Builder(Entry);
+  Value *Zero = ConstantInt::get(I8, 0), *One = ConstantInt::get(I8, 1);
+  // LLVM 13 added the alignment of cmpxchg
+#if LLVM_VERSION_MAJOR < 13
+  Value *Swap = Builder.CreateAtomicCmpXchg(Claimed, Zero, One,
+                                            AtomicOrdering::Acquire,
+                                            AtomicOrdering::Acquire);
+#else
+  Value *Swap = Builder.CreateAtomicCmpXchg(Claimed, Zero, One, MaybeAlign(),
+                                            AtomicOrdering::Acquire,
+                                            AtomicOrdering::Acquire);
+#endif
+  Builder.CreateCondBr(Builder.CreateExtractValue(Swap, 1), Decode, Wait);
+
+  BasicBlock *BB = Decode;
+  for (const Table &T : Tables)
+    BB = emitDecodeLoop(BB, T);
+  Builder.SetInsertPoint(BB);
+  StoreInst *Set = Builder.CreateStore(One, Ready);
+  Set->setAlignment(toAlign(1));
+  Set->setAtomic(AtomicOrdering::Release);
+  Builder.CreateRetVoid();
+
+  Builder.SetInsertPoint(Wait);
+  LoadInst *Done = Builder.CreateLoad(I8, Ready);
+  Done->setAlignment(toAlign(1));
+  Done->setAtomic(AtomicOrdering::Acquire);
+  Builder.CreateCondBr(Builder.CreateTrunc(Done, Type::getInt1Ty(Ctx)), Exit,
+                       Wait);
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return Decoder;
+}
+
+// Calls Decoder from the entry block of F while Ready is not set. The check
+// is placed after the allocas, which stay in the entry block. It has no
+// constant operand, so the pass leaves it as it is
+void insertGuard(Function &F, Function *Decoder, GlobalVariable *Ready) {
+  LLVMContext &Ctx = F.getContext();
+  BasicBlock *Entry = &F.getEntryBlock();
+  BasicBlock::iterator It = Entry->getFirstInsertionPt();
+  while (isa<AllocaInst>(*It))
+    ++It;
+  BasicBlock *Body = Entry->splitBasicBlock(It);
+  BasicBlock *Init = BasicBlock::Create(Ctx, "obfconst.init", &F, Body);
+  Entry->getTerminator()->eraseFromParent();
+
+  IRBuilder<> Builder(Entry);
+  LoadInst *Done = Builder.CreateLoad(Type::getInt8Ty(Ctx), Ready);
+  Done->setAlignment(toAlign(1));
+  Done->setAtomic(AtomicOrdering::Acquire);
+  Builder.CreateCondBr(Builder.CreateTrunc(Done, Type::getInt1Ty(Ctx)), Body,
+                       Init);
+  Builder.SetInsertPoint(Init);
+  Builder.CreateCall(Decoder);
+  Builder.CreateBr(Body);
+}
+
+} // namespace
+
+APInt inverse(const APInt &A) {
+  // A is its own inverse modulo 8, and every step of Newton's iteration
+  // doubles the correct low bits
+  APInt X = A;
+  while (A * X != 1)
+    X *= 2 - A * X;
+  return X;
+}
+
+unsigned encodeTables(Module &M, unsigned MinElements) {
+  std::random_device dev;
+  std::mt19937 rng(dev());
+  std::vector<Table> Tables;
+  SmallSetVector<Function *, 8> Users;
+
+  std::vector<GlobalVariable *> Globals;
+  for (GlobalVariable &GV : M.globals())
+    Globals.push_back(&GV);
+  for (GlobalVariable *GV : Globals) {
+    ConstantDataArray *Init = getTable(*GV, MinElements);
+    SmallSetVector<Function *, 8> TableUsers;
+    if (!Init || !collectUsers(GV, TableUsers) || TableUsers.empty())
+      continue;
+    Users.insert(TableUsers.begin(), TableUsers.end());
+    Tables.push_back(encodeTable(*GV, *Init, rng));
+  }
+  if (Tables.empty())
+    return 0;
+
+  Type *I8 = Type::getInt8Ty(M.getContext());
+  auto *Ready = new GlobalVariable(M, I8, false, GlobalValue::InternalLinkage,
+                                   ConstantInt::get(I8, 0), "obfconst.ready");
+  Function *Decoder = createDecoder(M, Tables, Ready);
+  for (Function *F : Users)
+    insertGuard(*F, Decoder, Ready);
+  return Tables.size();
+}
+
+} // namespace obfconst
@@ -0,0 +1,29 @@
+// Encoding of constant integer tables (S-boxes, round constants...)
+//
+// A table is stored encoded element by element with an affine map, and its
+// uses read a writable copy instead. The copy is decoded once, by the first
+// function using a table to run: every such function checks a flag in its
+// entry block, and calls the decoder while it is not set. The decoder is
+// guarded by an atomic compare-and-swap, so concurrent first calls decode
+// once and the others wait for the flag. Past the first call, a table
+// lookup is the same load as before, only the entry of the functions costs
+// one load and one branch.
+#ifndef OBF_CONST_TABLES_H
+#define OBF_CONST_TABLES_H
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/IR/Module.h"
+
+namespace obfconst {
+
+// The inverse of the odd A modulo 2^n, n the width of A
+llvm::APInt inverse(const llvm::APInt &A);
+
+// Encode the internal constant arrays of integers of M that have at least
+// MinElements elements and are only read by instructions, and make their
+// users decode them on first use. Returns the number of encoded tables
+unsigned encodeTables(llvm::Module &M, unsigned MinElements);
+
+} // namespace obfconst
+
+#endif
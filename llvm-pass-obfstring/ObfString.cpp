@@ -61,12 +61,15 @@ Function *createDecodeStubFunc(Module &M, vector<GlobalString *> &GlobalStrings,
     if (GlobString->type == GlobString->SIMPLE_STRING_TYPE) {
       auto *StrPtr =
           Builder.CreatePointerCast(GlobString->Glob, Type::getInt8PtrTy(Ctx));
-      Builder.CreateCall(DecodeFunc, {StrPtr}); // CHANGE: removed le
+      Builder.CreateCall(DecodeFunc->getFunctionType(), DecodeFunc,
+                         {StrPtr}); // CHANGE: removed le
     } else if (GlobString->type == GlobString->STRUCT_STRING_TYPE) {
       auto *String =
-          Builder.CreateStructGEP(GlobString->Glob, GlobString->index);
+          Builder.CreateStructGEP(GlobString->Glob->getValueType(),
+                                  GlobString->Glob, GlobString->index);
       auto *StrPtr = Builder.CreatePointerCast(String, Type::getInt8PtrTy(Ctx));
-      Builder.CreateCall(DecodeFunc, {StrPtr}); // CHANGE: removed le
+      Builder.CreateCall(DecodeFunc->getFunctionType(), DecodeFunc,
+                         {StrPtr}); // CHANGE: removed le
     }
   }
   Builder.CreateRetVoid();
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Compare the per-predicate globals of the bogus pass with the pooled state
+# (-bogus_pool_size): number of globals, time to load the obfuscated module,
+# time to link it and size of the binary.
+#
+# usage: ./measure.sh <path to libBogusFlowPass.so> <bitcode file> [pool size]
+# The module is linked with $CC (default clang), set CC=clang++ for C++.
+
+pool=${3:-16}
+out=`basename $2`_pool.txt
+rm -f $out
+TIMEFORMAT='%3R'
+
+echo "mode,globals,load,link,size" >> $out
+for size in 0 $pool
+  do
+    opt -load $1 -bogus -bogus_pool_size=$size $2 -o obf_$size.bc
+    globals=`llvm-dis obf_$size.bc -o - | grep -c '^@'`
+    load=`{ time opt -verify obf_$size.bc -o /dev/null; } 2>&1`
+    link=`{ time ${CC:-clang} obf_$size.bc -o obf_$size; } 2>&1`
+    echo "$size,$globals,$load,$link,`stat -c %s obf_$size`" >> $out
+    rm -f obf_$size.bc obf_$size
+  done
+cat $out
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Measure how the running time of the bogus pass scales with the number of
+# functions in a module. The pass should scale linearly.
+#
+# usage: ./benchmark.sh <path to libBogusFlowPass.so>
+
+out=bogus_scaling_bench.txt
+rm -f $out
+TIMEFORMAT='%3U'
+min=1000
+max=20000
+inc=1000
+for i in $(seq $min $inc $max)
+  do
+    # Generate a module with $i small functions, each with a few branches
+    rm -f gen.c
+    for f in $(seq 1 $i)
+      do
+        echo "int f$f(int a, int b) { if (a > b) return a - b; return b * $f; }" >> gen.c
+      done
+    clang -S -emit-llvm -O0 -Xclang -disable-O0-optnone gen.c -o gen.ll
+
+    echo -n "$i," >> $out
+    echo $i
+    (time opt -load $1 -bogus gen.ll -o /dev/null) >> /dev/null 2>> $out
+  done
+
+rm -f gen.c gen.ll
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Count the encoded constants of the qsort, sha and plusaes benchmarks left
+# after -O2, with the literal encodings and with -obfconst_live. Every
+# decoded value carries !obfconst metadata, so the count is a lower bound:
+# an encoding rewritten by InstCombine loses its mark without being folded.
+#
+# usage: ./survive.sh <path to libObfConstPass.so> [obfconst options]
+# e.g.   ./survive.sh ../../build/llvm-pass-obfconst/libObfConstPass.so -obfconst_pool=loop
+
+pass=$1
+shift
+dir=`dirname $0`
+
+for src in $dir/../qsort/qsort.c $dir/../sha/test.cpp $dir/../plusaes/main.cpp
+  do
+    name=`basename $(dirname $src)`
+    case $src in
+      *.c) cc="clang" ;;
+      *) cc="clang++ -std=c++17" ;;
+    esac
+    $cc -O0 -Xclang -disable-O0-optnone -S -emit-llvm $src -o $name.ll
+    for mode in "" -obfconst_live
+      do
+        opt -load $pass -obfconst $mode "$@" $name.ll -o ${name}_const.bc 2> /dev/null
+        encoded=`llvm-dis ${name}_const.bc -o - | grep -c '!obfconst !'`
+        left=`opt -O2 ${name}_const.bc -o - | llvm-dis -o - | grep -c '!obfconst !'`
+        echo "$name: $left of $encoded encodings left after -O2 with -obfconst $mode $@"
+        rm -f ${name}_const.bc
+      done
+    rm -f $name.ll
+  done
@@ -0,0 +1,24 @@
+; The encoding of 1000 in f can only be built on %n and on %p, which is
+; undef when f is called with %c false. Built on an undef or poison value,
+; the zero-valued expression of -obfconst_live is not zero anymore and f
+; returns garbage instead of 7000.
+define i32 @f(i32 %n, i1 %c) {
+entry:
+  br i1 %c, label %a, label %join
+
+a:
+  %v = add i32 %n, 1
+  br label %join
+
+join:
+  %p = phi i32 [ %v, %a ], [ undef, %entry ]
+  %r = mul i32 %n, 1000
+  ret i32 %r
+}
+
+define i32 @main() {
+  %r = call i32 @f(i32 7, i1 false)
+  %ok = icmp eq i32 %r, 7000
+  %ret = select i1 %ok, i32 0, i32 1
+  ret i32 %ret
+}
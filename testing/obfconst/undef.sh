@@ -0,0 +1,22 @@
+#!/bin/bash
+# Check that -obfconst_live does not build its encodings on undef values:
+# run undef.ll through the pass and -O2 a few times, it must return 0.
+#
+# usage: ./undef.sh <path to libObfConstPass.so>
+
+pass=$1
+dir=`dirname $0`
+
+for i in $(seq 1 10)
+  do
+    opt -load $pass -obfconst -obfconst_live $dir/undef.ll -o undef_const.bc
+    opt -O2 undef_const.bc -o undef_opt.bc
+    if ! lli undef_opt.bc; then
+      echo "FAIL: f(7, false) != 7000"
+      llvm-dis undef_opt.bc -o -
+      rm -f undef_const.bc undef_opt.bc
+      exit 1
+    fi
+  done
+rm -f undef_const.bc undef_opt.bc
+echo "OK"
@@ -0,0 +1,211 @@
+// Micro-benchmark of the opaque predicates of the bogus pass
+// (llvm-pass-bogus/Bogus.cpp). Every predicate is evaluated on its own in a
+// tight loop feeding a branch, the same way the pass uses it, and the cost
+// per evaluation is reported from hardware counters (perf_event_open) when
+// they are available, wall-clock time otherwise.
+//
+// The predicates and the size of the symbolic arrays come from predicates.h,
+// which PredicateHeader prints from the library of the pass at build time.
+//
+// usage: ./PredicateBench [iterations in millions]
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "predicates.h"
+
+#define INPUTS (1 << 16)
+// Default of -bogus_sym_tables
+#define SYM_TABLES 8
+
+// Keep the compiler from seeing through the arrays of symbolic predicates,
+// like LLVM cannot see through loads with a variable index
+#define BARRIER(p) __asm__ volatile("" : : "r"(p) : "memory")
+// Hide the value of the operands, so that no predicate is folded
+#define OPAQUE(v) __asm__("" : "+r"(v))
+
+static int32_t in[INPUTS + 1];
+static volatile long sink;
+
+// Tables of -bogus_sym_state=global, not static so they are not constant.
+// Filled with random permutations by main, like the pass does
+unsigned char bogus_sym_tables[SYM_TABLES][2 * SYM_SIZE];
+
+// GCC knows that squares are 0 or 1 modulo 4 (LLVM does not), hide the
+// squares of the predicates
+static inline int32_t square(int32_t v) {
+  int32_t m = v * v;
+  OPAQUE(m);
+  return m;
+}
+#define SQUARE(v) square(v)
+
+// Taken when a predicate is false, i.e. never
+__attribute__((noinline)) static void altered(int x) { sink += x; }
+
+/*
+ * Predicates, on x and y from function arguments (srem by 127 like
+ * getSimpleOP) or on the argument itself for the symbolic ones
+ */
+#define ARGS                                                                   \
+  int32_t x = a % 127;                                                         \
+  int32_t y = b % 127;                                                         \
+  OPAQUE(x);                                                                   \
+  OPAQUE(y);
+
+#define P_BASELINE ARGS int r = x != 1000;
+
+#define P_SYM_BLOCK                                                            \
+  int64_t arr1[SYM_SIZE], arr2[SYM_SIZE];                                      \
+  volatile int32_t slot = a;                                                   \
+  for (int k = 0; k < SYM_SIZE; ++k) {                                         \
+    arr1[k] = k;                                                               \
+    arr2[k] = k;                                                               \
+  }                                                                            \
+  BARRIER(arr1);                                                               \
+  BARRIER(arr2);                                                               \
+  int r = arr2[arr1[(uint64_t)(int64_t)slot % SYM_SIZE]] != SYM_SIZE;
+
+#define P_SYM_ENTRY                                                            \
+  int r = arr2[arr1[(uint64_t)(int64_t)a % SYM_SIZE]] != SYM_SIZE;
+
+#define P_SYM_GLOBAL                                                           \
+  unsigned char *t = bogus_sym_tables[1];                                      \
+  int r = t[SYM_SIZE + t[(uint64_t)(int64_t)a % SYM_SIZE]] != SYM_SIZE;
+
+#define DEFINE_LOOP(name, pred)                                                \
+  __attribute__((noinline)) static void loop_##name(long iters) {              \
+    int64_t arr1[SYM_SIZE], arr2[SYM_SIZE];                                    \
+    for (int k = 0; k < SYM_SIZE; ++k) {                                       \
+      arr1[k] = k;                                                             \
+      arr2[k] = k;                                                             \
+    }                                                                          \
+    BARRIER(arr1);                                                             \
+    BARRIER(arr2);                                                             \
+    for (long i = 0; i < iters; ++i) {                                         \
+      int32_t a = in[i & (INPUTS - 1)];                                        \
+      int32_t b = in[(i & (INPUTS - 1)) + 1];                                  \
+      pred if (!r) altered(a);                                                 \
+    }                                                                          \
+  }
+
+// One loop per predicate of the library
+#define DEFINE_PREDICATE_LOOP(id, name, expr)                                  \
+  DEFINE_LOOP(p##id, ARGS int r = expr;)
+
+DEFINE_LOOP(baseline, P_BASELINE)
+PREDICATES(DEFINE_PREDICATE_LOOP)
+DEFINE_LOOP(sym_block, P_SYM_BLOCK)
+DEFINE_LOOP(sym_entry, P_SYM_ENTRY)
+DEFINE_LOOP(sym_global, P_SYM_GLOBAL)
+
+struct bench {
+  const char *name;
+  void (*loop)(long);
+};
+
+#define PREDICATE_BENCH(id, name, expr) {name, loop_p##id},
+
+static const struct bench benches[] = {
+    {"baseline", loop_baseline},
+    PREDICATES(PREDICATE_BENCH)
+    {"sym (block)", loop_sym_block},
+    {"sym (entry)", loop_sym_entry},
+    {"sym (global)", loop_sym_global},
+};
+
+enum { CYCLES, INSTRUCTIONS, BRANCH_MISSES, COUNTERS };
+
+static int open_counter(uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+  long iters = (argc > 1 ? atol(argv[1]) : 100) * 1000000L;
+  uint64_t configs[COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES,
+                                PERF_COUNT_HW_INSTRUCTIONS,
+                                PERF_COUNT_HW_BRANCH_MISSES};
+  int fds[COUNTERS];
+
+  srand(42);
+  for (int i = 0; i <= INPUTS; ++i) {
+    in[i] = rand() - RAND_MAX / 2;
+  }
+  for (int v = 0; v < SYM_TABLES; ++v) {
+    for (int k = 0; k < 2 * SYM_SIZE; ++k) {
+      bogus_sym_tables[v][k] = k % SYM_SIZE;
+    }
+    for (int k = SYM_SIZE - 1; k > 0; --k) {
+      for (int half = 0; half < 2; ++half) {
+        unsigned char *arr = bogus_sym_tables[v] + half * SYM_SIZE;
+        int j = rand() % (k + 1);
+        unsigned char tmp = arr[k];
+        arr[k] = arr[j];
+        arr[j] = tmp;
+      }
+    }
+  }
+
+  fds[0] = open_counter(configs[0], -1);
+  for (int c = 1; c < COUNTERS; ++c) {
+    fds[c] = fds[0] == -1 ? -1 : open_counter(configs[c], fds[0]);
+  }
+  int counters = fds[0] != -1 && fds[1] != -1 && fds[2] != -1;
+  if (!counters) {
+    fprintf(stderr, "perf_event_open not available, reporting time only\n");
+  }
+
+  printf("%-26s %10s %10s %10s %10s\n", "predicate", "ns", "cycles",
+         "instrs", "br-misses");
+  for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); ++b) {
+    uint64_t values[1 + COUNTERS] = {0};
+    benches[b].loop(iters / 10); // warm up
+
+    if (counters) {
+      ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    double start = now();
+    benches[b].loop(iters);
+    double elapsed = now() - start;
+    if (counters) {
+      ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+      if (read(fds[0], values, sizeof(values)) != sizeof(values)) {
+        counters = 0;
+      }
+    }
+
+    printf("%-26s %10.3f", benches[b].name, elapsed * 1e9 / iters);
+    if (counters) {
+      printf(" %10.3f %10.3f %10.5f\n", (double)values[1 + CYCLES] / iters,
+             (double)values[1 + INSTRUCTIONS] / iters,
+             (double)values[1 + BRANCH_MISSES] / iters);
+    } else {
+      printf(" %10s %10s %10s\n", "-", "-", "-");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/bash
+# Count the loops of the sha and plusaes benchmarks vectorized by -O2,
+# without obfuscation and after the bogus pass with the given options.
+#
+# usage: ./check.sh <path to libBogusFlowPass.so> [bogus options]
+# e.g.   ./check.sh ../../build/llvm-pass-bogus/libBogusFlowPass.so -bogus_loops=outer
+
+pass=$1
+shift
+dir=`dirname $0`
+
+for src in $dir/../sha/test.cpp $dir/../plusaes/main.cpp
+  do
+    name=`basename $(dirname $src)`
+    clang++ -std=c++17 -O0 -Xclang -disable-O0-optnone -S -emit-llvm $src -o $name.ll
+    plain=`opt -O2 -pass-remarks=loop-vectorize $name.ll -o /dev/null 2>&1 | grep -c "vectorized loop"`
+    opt -load $pass -bogus "$@" $name.ll -o ${name}_bogus.bc
+    bogus=`opt -O2 -pass-remarks=loop-vectorize ${name}_bogus.bc -o /dev/null 2>&1 | grep -c "vectorized loop"`
+    echo "$name: $plain vectorized loops, $bogus after -bogus $@"
+    rm -f $name.ll ${name}_bogus.bc
+  done